@@ -1,4 +1,4 @@
-
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,10 +8,110 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <linux/sched.h>
+#include <mntent.h>
+#include <sys/prctl.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <linux/perf_event.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <sys/epoll.h>
+
+//USDT probes for bpftrace and perf. They compile to a nop plus an ELF note, so they cost
+//nothing until attached; without <sys/sdt.h> they compile away entirely
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MYSH_PROBE0(name) DTRACE_PROBE(mysh, name)
+#define MYSH_PROBE1(name, a) DTRACE_PROBE1(mysh, name, a)
+#define MYSH_PROBE2(name, a, b) DTRACE_PROBE2(mysh, name, a, b)
+#define MYSH_PROBE3(name, a, b, c) DTRACE_PROBE3(mysh, name, a, b, c)
+#endif
+#endif
+#ifndef MYSH_PROBE0
+#define MYSH_PROBE0(name) do { } while (0)
+#define MYSH_PROBE1(name, a) do { } while (0)
+#define MYSH_PROBE2(name, a, b) do { } while (0)
+#define MYSH_PROBE3(name, a, b, c) do { } while (0)
+#endif
 
 #define MAX_ARGS 100
 #define MAX_CMD_LENGTH 1024
 #define MAX_CMDS 10
+#define MAX_CPUS 1024
+#define MAX_JOBS 64
+#define MAX_QUEUED_JOBS 256
+#define NUM_PERF_COUNTERS 6
+
+//Scheduling attributes applied in the child before exec
+enum {
+    SCHED_SET_NICE = 1 << 0,
+    SCHED_SET_POLICY = 1 << 1,
+    SCHED_SET_IOPRIO = 1 << 2,
+    SCHED_SET_LIMIT_AS = 1 << 3,
+    SCHED_SET_LIMIT_NOFILE = 1 << 4,
+    SCHED_SET_LIMIT_CPU = 1 << 5,
+};
+
+typedef struct {
+    int set;               // SCHED_SET_* flags of the fields given
+    int nice;              // Nice level
+    int policy;            // SCHED_OTHER, SCHED_BATCH or SCHED_IDLE
+    int ioprio;            // I/O priority as (class << 13) | level
+    rlim_t limit_as;       // RLIMIT_AS in bytes
+    rlim_t limit_nofile;   // RLIMIT_NOFILE
+    rlim_t limit_cpu;      // RLIMIT_CPU in seconds
+} SchedAttrs;
+
+//cgroup v2 limits written to a job's group. NULL leaves the file alone
+typedef struct {
+    char *memory_max;      // memory.max, e.g. "1073741824" or "max"
+    char *cpu_max;         // cpu.max, e.g. "50000 100000"
+    char *io_max;          // io.max, e.g. "8:0 rbps=1048576"
+} CgroupLimits;
+
+typedef struct BraceGen BraceGen;
+
+//One part of a brace-expanded word: a list of words, or a numeric or character sequence
+typedef struct {
+    char **words;          // Literal text or alternatives, NULL for a sequence
+    int num_words;
+    BraceGen **nested;     // Generator for the braces inside each alternative, NULL if none
+    unsigned long long *ends; // Values produced up to and including each alternative
+    long start;            // First value of a sequence
+    long step;
+    int width;             // Zero-padded width of a sequence, 0 for none
+    int is_char;           // Sequence of characters like {a..e}
+    unsigned long long count; // Number of values
+} BracePart;
+
+//Generator for the words of a brace expansion, produced in order without storing them
+struct BraceGen {
+    BracePart *parts;
+    int num_parts;
+    unsigned long long *index; // Odometer over the parts, the last part changing fastest
+    unsigned long long total;
+    unsigned long long produced;
+    size_t max_len;        // Longest word that can be produced
+};
 
 typedef struct {
     char **args;           // Argument vector
@@ -19,17 +119,451 @@ typedef struct {
     char *output_file;     // Output redirection file
     int append;            // Flag for appending output (1 if '>>' is used)
     int background;        // Flag for background execution
+    char *cpus;            // CPU list from '@cpus=' (NULL uses the affinity policy)
+    cpu_set_t affinity;    // CPUs the process is pinned to
+    int has_affinity;      // Flag for applying affinity in the child
+    SchedAttrs sched;      // Scheduling attributes from '@nice=', '@sched=', ...
+    CgroupLimits limits;   // cgroup limits from '@memory.max=', '@cpu.max=', '@io.max='
+    BraceGen *stream;      // Brace expansion too large for one argv, streamed into batches
+    int stream_at;         // Index in args where the streamed words go
+    char **assignments;    // NAME=value words before the command, NULL-terminated
+    int input_dup;         // Descriptor from '<&N', -1 for none
+    int output_dup;        // Descriptor from '>&N', -1 for none
+    char *read_stream;     // Stream named by '<-name', NULL for none
+    char *write_stream;    // Stream named by '->name' or '=>name', NULL for none
+    int write_atomic;      // Flag for '=>': whole lines interleaved with the stream's other writers
 } Cmd;
 
+//Argument packer for one command run as many times as needed to stay under ARG_MAX
+typedef struct {
+    char **argv;           // Fixed leading arguments, batch words, trailing arguments, NULL
+    int num_prefix;
+    char **tail;           // Arguments placed after each batch
+    int num_tail;
+    int count;             // Words in the current batch
+    int max_words;
+    char *arena;           // Storage for the words of the current batch
+    size_t limit;          // Bytes the batch words may use, pointers included
+    size_t used;
+    int max_count;         // Words per batch, 0 for as many as fit
+    int parallel;          // Batches allowed to run at once
+    int running;
+    pid_t *pids;           // Running batches, with a pidfd each to wait for whichever ends first
+    int *pidfds;
+    int status;            // Combined status, like xargs
+    int exec_failed;       // The command could not be run; later batches are skipped
+    const Cmd *cmd;        // Command whose attributes each batch gets, NULL for none
+} Batcher;
+
 typedef struct {
     Cmd commands[MAX_CMDS];
     int num_commands;
+    int perfstat;          // Flag for a line starting with 'perfstat'
 } CmdSet;
 
 //Track PIDs of foreground processes
-pid_t foreground_pids[MAX_CMDS];  
+pid_t foreground_pids[2 * MAX_CMDS];
 int num_foreground_pids = 0;
 
+//A pipeline started by execute_commands
+typedef struct {
+    int id;                // Job number, 0 if the slot is free
+    pid_t pids[MAX_CMDS];  // PIDs of the pipeline stages
+    int num_pids;
+    int num_running;       // Stages that have not exited yet
+    int background;        // Flag for background jobs
+    int status;            // Wait status of the last stage
+    char cmdline[256];     // Command line shown to the user
+    struct rusage usage;   // Summed rusage of the stages as they are reaped
+    int cgroup_fd;         // Directory fd of the job's cgroup, -1 without one
+    long long memory_peak; // memory.peak of the job's cgroup in bytes
+    long long cpu_usec;    // usage_usec from the cgroup's cpu.stat
+    int collected;         // Flag set once the cgroup has been read and removed
+    struct timespec started;   // CLOCK_MONOTONIC when the job was created
+    struct timespec finished;  // CLOCK_MONOTONIC when its last stage exited
+    int perf;              // PERF_OFF, PERF_COUNT or PERF_REPORT
+    int perf_fds[MAX_CMDS][NUM_PERF_COUNTERS];     // Counters of each stage until it exits, -1 if closed
+    signed char perf_kinds[MAX_CMDS][NUM_PERF_COUNTERS];   // PERF_KIND_* of each counter
+    unsigned long long perf_counts[MAX_CMDS][NUM_PERF_COUNTERS];
+} Job;
+
+//Hardware counters per job, with software fallbacks where the PMU is unavailable
+enum { PERF_OFF, PERF_COUNT, PERF_REPORT };
+enum { PERF_KIND_NONE, PERF_KIND_PRIMARY, PERF_KIND_FALLBACK };
+
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    const char *fallback_name;   // NULL if there is no software equivalent
+    uint32_t fallback_type;
+    uint64_t fallback_config;
+} PerfCounter;
+
+const PerfCounter perf_counters[NUM_PERF_COUNTERS] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cpu-clock-ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, NULL, 0, 0 },
+    { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, NULL, 0, 0 },
+    { "task-clock-ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, NULL, 0, 0 },
+    { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, NULL, 0, 0 },
+    { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, NULL, 0, 0 },
+};
+
+//Count every job, set with 'perf'
+int perf_accounting = 0;
+
+//Job table. Slots are updated from signal_handler, so SIGCHLD is blocked while editing them
+Job jobs[MAX_JOBS];
+int next_job_id = 1;
+//Job the PIDs of execute_single_command are added to
+Job *current_job = NULL;
+//Job of the last foreground pipeline, for its exit status
+Job *foreground_job = NULL;
+//Exit status of the last foreground command line
+int last_status = 0;
+//PID of the last background command, for $!
+pid_t last_background_pid = 0;
+
+//'spawn parallel' creates every pipe of a pipeline before the first fork, 'spawn serial' each
+//one just before its stage. Either way no exec is confirmed until every stage is forked
+int spawn_parallel = 0;
+//Pipes of the pipeline being started, closed by each child after its dup2s. Every stage has
+//one input and one output, so even a stream graph needs at most two pipes per stage
+int pipeline_fds[4 * MAX_CMDS];
+int num_pipeline_fds = 0;
+//In a child, the command it runs; xargs batches take its attributes. NULL in the shell
+const Cmd *child_cmd = NULL;
+//Exec status pipes still to be read in parallel mode, in stage order
+typedef struct {
+    int fd;
+    const char *name;
+} PendingExec;
+PendingExec pending_execs[MAX_CMDS];
+int num_pending_execs = 0;
+//Set while a foreground pipeline is started: its exec status is queued in pending_execs
+//and read by wait_pending_execs after the last fork
+int defer_exec_status = 0;
+//Exec status pipes of background stages, read at the next prompt so a stage that blocks
+//before exec (say, opening a FIFO) never holds up the shell. Names are copies
+#define MAX_BACKGROUND_EXECS 64
+PendingExec background_execs[MAX_BACKGROUND_EXECS];
+int num_background_execs = 0;
+
+//Process joining the writers of a named stream to its readers when it has more than one of
+//either. Writers go out in stage order, or line by line for a '=>' stream
+#define RELAY_CHUNK 65536
+#define RELAY_BUFFER_MAX (8 << 20)   // Output held per waiting writer of an ordered stream
+typedef struct {
+    int inputs[MAX_CMDS];  // Read ends of the writers' pipes, in stage order
+    int num_inputs;
+    int outputs[MAX_CMDS]; // Write ends of the readers' pipes
+    int num_outputs;
+    int atomic;            // Flag for a '=>' stream
+} StreamRelay;
+
+//Producer of 'merge' and the bytes read from it but not yet written
+#define MERGE_BUFFER (1 << 20)
+typedef struct {
+    int fd;                // Read end of its pipe, -1 after end of file
+    int job_id;            // Shown by 'merge -p'
+    char *data;
+    size_t start;          // data[start..len) is still to be written
+    size_t len;
+    int armed;             // Flag for being watched by epoll
+} MergeInput;
+
+//Coprocess started with 'coproc': the shell writes to in_fd and reads from out_fd. Replies are
+//read through a buffer, since only the shell reads that pipe
+#define MAX_COPROCS 8
+typedef struct {
+    char name[64];         // Empty for a free slot
+    int in_fd;
+    int out_fd;
+    pid_t pid;
+    char buffer[4096];
+    size_t buffer_start;
+    size_t buffer_end;
+} Coproc;
+Coproc coprocs[MAX_COPROCS];
+//Descriptor named by '<&N' while a builtin runs inside the shell, -1 otherwise
+int builtin_input_dup = -1;
+//Wall time of the last command line, for the prompt
+uint64_t last_duration_ns = 0;
+
+//Admission thresholds for background jobs. 0 disables a check
+typedef struct {
+    double cpu;            // Limit on 'some avg10' of /proc/pressure/cpu, in percent
+    double memory;         // Limit on 'some avg10' of /proc/pressure/memory
+    double io;             // Limit on 'some avg10' of /proc/pressure/io
+    int max_jobs;          // Limit on running background jobs
+} Admission;
+
+Admission admission = { 0, 0, 0, 0 };
+
+//Background jobs held back by admission control, oldest first
+CmdSet queued_jobs[MAX_QUEUED_JOBS];
+int num_queued_jobs = 0;
+
+//Throughput of a 'meter' stage, shared with the shell for 'jobs --top'
+typedef struct {
+    pid_t pid;                     // Meter process, 0 if the slot is unused
+    unsigned long long bytes;      // Bytes relayed so far
+    unsigned long long lines;      // Lines relayed so far (with -l)
+    unsigned long long rate;       // Bytes per second over the last interval
+} MeterStats;
+
+//One slot per job and stage, mapped shared before any child is forked
+MeterStats (*meter_stats)[MAX_CMDS] = NULL;
+
+//Session log written with --record or 'record'. The file starts with SESSION_MAGIC and
+//holds one SessionRecord per command line, followed by the line and the working directory
+#define SESSION_MAGIC "MYSHREC1"
+
+typedef struct {
+    uint64_t time_ns;      // CLOCK_REALTIME when the line was read
+    uint64_t parse_ns;     // Time spent in parse_command
+    uint64_t spawn_ns;     // Time spent in execute_commands
+    uint64_t wait_ns;      // Time spent waiting for the foreground job
+    int32_t status;        // Exit status of the line
+    uint16_t line_len;     // Bytes of command line that follow
+    uint16_t cwd_len;      // Bytes of working directory that follow, 0 if unchanged
+} SessionRecord;
+
+int record_fd = -1;
+char recorded_cwd[PATH_MAX];
+//Set by --replay --stub: children exit instead of running external commands
+int replay_stub = 0;
+
+//Command history shared by concurrent shells: an append-only file, mapped read-only.
+//Entries are named by the offset they start at and found from the tail on demand, so
+//opening a long history costs nothing. Other shells' appends show up on the next refresh
+typedef struct {
+    int fd;
+    char path[PATH_MAX];   // File name, checked for rotation on each refresh
+    char *map;             // Mapping of the file, NULL when it is empty
+    size_t map_len;
+    size_t complete_len;   // Bytes up to the last newline, the end of the newest entry
+    ssize_t count;         // Number of entries, -1 until the history builtin counts them
+} History;
+
+History history = { .fd = -1, .count = -1 };
+
+//Directory listing read with getdents64. Each entry is its d_type byte followed by its
+//NUL-terminated name
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+    int count;
+} DirListing;
+
+//Prefix trie of the executables on $PATH, built by completion_thread. Children are a
+//first-child/next-sibling list of indexes into one node array
+typedef struct {
+    char c;
+    int child;             // First child, -1 if none
+    int sibling;           // Next sibling, -1 if none
+    int count;             // PATH directories providing the name ending here
+} TrieNode;
+
+//Guards the trie. The prompt only ever try-locks it, so completion never waits for a scan
+pthread_mutex_t completion_lock = PTHREAD_MUTEX_INITIALIZER;
+TrieNode *trie = NULL;
+int trie_size = 0;
+int trie_capacity = 0;
+//PATH directories and the listing each contributed, indexed like the PATH entries
+char **path_dirs = NULL;
+DirListing *path_listings = NULL;
+int num_path_dirs = 0;
+
+//Git state of one directory for the prompt, computed by prompt_thread
+#define PROMPT_CACHE_SIZE 32
+typedef struct {
+    char dir[PATH_MAX];
+    char branch[64];       // Empty outside a repository
+    int dirty;             // 1 dirty, 0 clean, -1 unknown (status over budget or still running)
+    uint64_t used;         // Prompt counter at last use, for eviction
+} GitState;
+
+//Prompt format set with 'prompt'. Expensive segments come from prompt_cache, which the
+//prompt never waits for: prompt_thread refreshes it and pokes prompt_notify to redraw
+char prompt_format[MAX_CMD_LENGTH] = "mysh: ";
+GitState prompt_cache[PROMPT_CACHE_SIZE];
+uint64_t prompt_counter = 0;
+int prompt_budget_ms = 1000;       // Time allowed for 'git status' before giving up
+pthread_mutex_t prompt_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t prompt_wakeup = PTHREAD_COND_INITIALIZER;
+char prompt_request[PATH_MAX];     // Directory waiting to be refreshed, empty if none
+char **prompt_request_envp = NULL; // Copy of the environment for its git, owned by the request
+int prompt_notify[2] = { -1, -1 };
+int prompt_thread_started = 0;
+
+//Shell variable. Exported ones are passed to commands through cached_envp
+typedef struct {
+    char *name;            // NULL for an empty slot
+    char *value;
+    int exported;
+    int interned;          // value belongs to the intern pool and is never freed
+    uint32_t hash;
+} Variable;
+
+//Short variable values are interned: a word that is exactly $NAME then uses the value
+//itself instead of a copy, and repeated assignments of the same value share storage
+#define INTERN_CAPACITY 4096
+#define INTERN_MAX_LEN 256
+const char *intern_pool[INTERN_CAPACITY];
+int intern_count = 0;
+
+//Bump allocator for the words of one command line. It is reset when the next line is parsed,
+//keeping its chunks, so steady-state parsing allocates nothing
+#define ARENA_CHUNK_SIZE 65536
+typedef struct {
+    char **chunks;
+    size_t *sizes;
+    int num_chunks;
+    int current;
+    size_t used;           // Bytes used in the current chunk
+} LineArena;
+
+LineArena line_arena;
+//Set when a $(( )) in the line being parsed fails; the line is not run, like in bash
+int expansion_failed = 0;
+
+//Output of the expander: a word being built at the end of the arena, or in a fixed buffer
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t capacity;
+    int in_arena;
+} ExpandOut;
+
+//Compiled arithmetic expression. Stack machine instructions; names index the variables used
+typedef struct {
+    int op;
+    long long value;       // Constant, jump target or name index
+} ArithInsn;
+
+typedef struct {
+    char *text;            // Source, the cache key
+    ArithInsn *code;
+    int length;
+    char **names;
+    int num_names;
+} ArithProgram;
+
+//Compiled expressions by source text, so a counter in a loop is parsed once
+#define ARITH_CACHE_SIZE 128
+ArithProgram *arith_cache[ARITH_CACHE_SIZE];
+
+//stat/lstat results for 'test', valid for one command line so that '[ -f x -a -r x -a -s x ]'
+//stats x once, while a later line sees changes
+#define STAT_CACHE_SIZE 16
+typedef struct {
+    char path[PATH_MAX];
+    int follow;            // stat rather than lstat
+    int result;            // 0, or the errno of the failed call
+    struct stat st;
+    unsigned generation;
+} StatCacheEntry;
+
+StatCacheEntry stat_cache[STAT_CACHE_SIZE];
+int stat_cache_next = 0;
+//Incremented for each parsed line, which invalidates the stat cache
+unsigned line_generation = 1;
+
+//Open-addressing hash table of variables, seeded from the inherited environment
+Variable *variables = NULL;
+size_t variables_capacity = 0;
+size_t variables_used = 0;        // Slots holding a variable or a tombstone
+//Environment of spawned commands, rebuilt only after an exported variable changes. It is
+//one pointer array and one block of NAME=value strings, and also serves as the shell's environ
+char **cached_envp = NULL;
+int envp_dirty = 1;
+
+//Directory listing shared between the glob cache and its readers; freed at the last release
+typedef struct {
+    DirListing listing;
+    int refs;
+} SharedListing;
+
+//Recently read directories for glob expansion, reused while the directory's mtime is unchanged
+#define DIR_CACHE_SIZE 64
+typedef struct {
+    char path[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    time_t listed;          // When the listing was read, to spot changes within the mtime granularity
+    SharedListing *shared;
+    uint64_t used;
+} DirCacheEntry;
+
+DirCacheEntry dir_cache[DIR_CACHE_SIZE];
+uint64_t dir_cache_counter = 0;
+pthread_mutex_t dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Paths matched by one glob pattern
+typedef struct {
+    char **paths;
+    int count;
+    int capacity;
+} GlobResults;
+
+//A '**' walk shared by the glob pool: a stack of directories still to visit
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    char **dirs;
+    int num_dirs;
+    int capacity;
+    int busy;               // Directories being visited right now
+    char **comps;           // Pattern components after the '**'
+    int num_comps;
+    int dir_only;
+    GlobResults results;
+} GlobWalk;
+
+//Threads that help the shell with '**' walks, started on first use
+pthread_mutex_t glob_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t glob_pool_wakeup = PTHREAD_COND_INITIALIZER;
+pthread_cond_t glob_pool_idle = PTHREAD_COND_INITIALIZER;
+GlobWalk *glob_pool_walk = NULL;
+unsigned glob_pool_generation = 0;
+int glob_pool_active = 0;
+int glob_pool_size = -1;
+
+//Builtin command run inside the shell. Returns the exit status
+typedef struct {
+    const char *name;
+    int (*fn)(char **args);
+} Builtin;
+
+//Affinity policy for pipeline stages
+enum { AFFINITY_OFF, AFFINITY_AUTO, AFFINITY_FIXED };
+int affinity_mode = AFFINITY_OFF;
+cpu_set_t affinity_fixed;
+
+//CPU topology read from /sys/devices/system/cpu
+typedef struct {
+    int cpu;
+    int package;           // physical_package_id (socket)
+    int l2;                // Lowest CPU sharing this CPU's L2 cache
+    int l3;                // Lowest CPU sharing this CPU's L3 cache
+} CpuInfo;
+
+CpuInfo cpu_topology[MAX_CPUS];
+int num_topology_cpus = -1;
+//Counts background jobs placed by the auto policy, used to rotate cache domains
+int background_placements = 0;
+
+//Default scheduling attributes for background jobs, set with 'sched'
+SchedAttrs background_sched;
+
+//Per-job cgroup v2 isolation, set with 'cgroup'
+int cgroup_enabled = 0;
+char cgroup_base[PATH_MAX];   // Delegated cgroup directory the shell was started in
+CgroupLimits cgroup_defaults;
+
 //Function declarations
 char *getCmd(const char *program_name);
 CmdSet parse_command(char *cmd);
@@ -37,15 +571,185 @@ void execute_commands(CmdSet *cmdset);
 void handle_foreground_pids();
 void cleanup_stray_processes();
 void execute_single_command(Cmd *cmd, int input_fd, int output_fd);
+void setup_child(const Cmd *cmd);
 void setup_redirection(Cmd *cmd);
+int apply_redirection(Cmd *cmd);
+int run_builtin_redirected(const Builtin *builtin, Cmd *cmd);
+void close_coproc_fds();
 void signal_handler(int signo);
 char **get_tokens(const char *line);
 void free_tokens(char **tokens);
+const Builtin *find_builtin(const char *name);
+int builtin_affinity(char **args);
+int parse_attribute(Cmd *cmd, const char *token);
+int parse_cpu_list(const char *list, cpu_set_t *set);
+void load_cpu_topology();
+void place_pipeline(CmdSet *cmdset);
+int builtin_sched(char **args);
+int parse_size(const char *text, rlim_t *size);
+void apply_sched_attrs(const SchedAttrs *attrs);
+void print_sched_attrs(const SchedAttrs *attrs);
+void reap_children();
+void record_exit(pid_t pid, int status, struct rusage *usage);
+Job *create_job(CmdSet *cmdset);
+int count_background_jobs();
+double read_pressure(const char *resource);
+int admit_background_job();
+void release_queued_jobs();
+void wait_queued_jobs();
+void free_cmdset(CmdSet *cmdset);
+int builtin_admission(char **args);
+int builtin_cgroup(char **args);
+int setup_cgroups();
+int create_job_cgroup(Job *job, CmdSet *cmdset);
+int write_cgroup_file(int dir_fd, const char *name, const char *value);
+void collect_finished_jobs();
+pid_t spawn_process(int cgroup_fd);
+int run_init(char **command);
+int builtin_jobs(char **args);
+void show_job_top(int first_sample);
+int builtin_meter(char **args);
+int run_command_line(char *cmd);
+int start_recording(const char *path);
+void record_line(const char *cmd, const char *cwd, const SessionRecord *timing);
+int run_replay(const char *path);
+int builtin_record(char **args);
+void open_perf_counters(Job *job, int stage, pid_t pid);
+void read_perf_counters(Job *job, int stage);
+void print_perf_report(Job *job);
+void print_job_accounting(Job *job);
+int builtin_perf(char **args);
+void open_history();
+void refresh_history();
+void add_history(const char *line);
+char *edit_line(const char *prompt, char *buf, size_t size);
+int builtin_history(char **args);
+int read_directory(int dir_fd, DirListing *listing);
+void start_completion();
+void *completion_thread(void *arg);
+int complete_command(char *buf, size_t size, size_t *len, size_t *pos);
+const char *render_prompt(int refresh);
+void *prompt_thread(void *arg);
+int builtin_prompt(char **args);
+int builtin_cd(char **args);
+int has_glob(const char *word);
+int expand_glob(const char *pattern, char ***args, int *count, int *capacity);
+BraceGen *parse_braces(const char *word);
+int next_brace_word(BraceGen *gen, char *out, size_t size);
+void free_braces(BraceGen *gen);
+int batch_init(Batcher *batch, char **prefix, int num_prefix, char **tail, int num_tail, int parallel);
+void batch_add(Batcher *batch, const char *word);
+int batch_finish(Batcher *batch);
+int builtin_xargs(char **args);
+void init_variables();
+const char *get_variable(const char *name);
+void set_variable(const char *name, const char *value, int export);
+void unset_variable(const char *name);
+char **current_envp();
+int is_assignment(const char *word);
+int builtin_export(char **args);
+int builtin_unset(char **args);
+void arena_reset();
+char *arena_strdup(const char *text);
+const char *expand_word(const char *word);
+CmdSet copy_cmdset(const CmdSet *cmdset);
+char **join_arithmetic_tokens(char **tokens);
+int evaluate_arithmetic(const char *text, long long *result);
+int builtin_let(char **args);
+int builtin_test(char **args);
+int report_exec_status(int fd, const char *name);
+int wait_pending_execs();
+void report_background_execs();
+int builtin_spawn(char **args);
+int builtin_coproc(char **args);
+int builtin_read(char **args);
+int check_streams(const CmdSet *cmdset);
+int builtin_merge(char **args);
+int wire_pipeline(CmdSet *cmdset, int *stage_input, int *stage_output);
+
+//Commands handled by the shell itself
+const Builtin builtins[] = {
+    { "affinity", builtin_affinity },
+    { "sched", builtin_sched },
+    { "admission", builtin_admission },
+    { "cgroup", builtin_cgroup },
+    { "jobs", builtin_jobs },
+    { "meter", builtin_meter },
+    { "record", builtin_record },
+    { "perf", builtin_perf },
+    { "history", builtin_history },
+    { "prompt", builtin_prompt },
+    { "cd", builtin_cd },
+    { "xargs", builtin_xargs },
+    { "export", builtin_export },
+    { "unset", builtin_unset },
+    { "let", builtin_let },
+    { "test", builtin_test },
+    { "[", builtin_test },
+    { "[[", builtin_test },
+    { "spawn", builtin_spawn },
+    { "coproc", builtin_coproc },
+    { "read", builtin_read },
+    { "merge", builtin_merge },
+};
 
 int main(int argc, char *argv[]) {
     const char *program_name = argv[0];
+    init_variables();
+
+    //Command line options
+    int i = 1;
+    const char *replay_path = NULL;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            if (start_recording(argv[++i]) < 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--stub") == 0) {
+            replay_stub = 1;
+        } else if (strcmp(argv[i], "--subreaper") == 0) {
+            //Orphaned grandchildren are reparented to the shell and reaped by signal_handler
+            if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0) {
+                perror("prctl(PR_SET_CHILD_SUBREAPER)");
+            }
+        } else if (strcmp(argv[i], "--init") == 0) {
+            //Everything after --init (and an optional --) is the command to supervise
+            i++;
+            if (i < argc && strcmp(argv[i], "--") == 0) {
+                i++;
+            }
+            int exit_code = run_init(&argv[i]);
+            if (exit_code >= 0) {
+                return exit_code;
+            }
+            break;
+        } else {
+            fprintf(stderr, "Error: Usage: %s [--record FILE] [--replay FILE [--stub]] [--subreaper] "
+                    "[--init [--] [command args...]]\n", program_name);
+            return 2;
+        }
+    }
+
     signal(SIGCHLD, signal_handler);  // Handle terminated background processes
 
+    //Meter stages report their throughput through shared memory
+    meter_stats = mmap(NULL, sizeof(MeterStats) * MAX_JOBS * MAX_CMDS, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (meter_stats == MAP_FAILED) {
+        meter_stats = NULL;
+    }
+
+    if (replay_path != NULL) {
+        return run_replay(replay_path);
+    }
+
+    //Index $PATH for tab completion in the background
+    if (isatty(STDIN_FILENO)) {
+        start_completion();
+    }
+
     while (1) {
         //Get command input
         char *cmd = getCmd(program_name);
@@ -53,17 +757,9 @@ int main(int argc, char *argv[]) {
         if(cmd == NULL){
             continue;
         }   
+        MYSH_PROBE2(line_read, cmd, strlen(cmd));
 
-        //Parse and execute commands
-        CmdSet cmdset = parse_command(cmd);
-
-        if (cmdset.num_commands > 0) {
-            //Execute parsed commands
-            execute_commands(&cmdset);
-        }
-
-        //Wait for foreground processes to finish 
-        handle_foreground_pids();  
+        run_command_line(cmd);
     }
 
     //Kill stray processes on exit
@@ -76,17 +772,40 @@ char *getCmd(const char *program_name) {
     static char cmd[MAX_CMD_LENGTH];
     char *result;
 
+    report_background_execs();
+
     //Print the prompt 
-    printf("mysh: ");
+    MYSH_PROBE0(prompt);
+    const char *prompt = render_prompt(1);
+    printf("%s", prompt);
     //Ensure prompt is printed immediately 
     fflush(stdout);
-    result = fgets(cmd, sizeof(cmd), stdin);
+
+    //Release queued background jobs while the user is idle at a terminal
+    release_queued_jobs();
+    struct pollfd input = { .fd = STDIN_FILENO, .events = POLLIN };
+    while (num_queued_jobs > 0 && isatty(STDIN_FILENO) && poll(&input, 1, 500) == 0) {
+        release_queued_jobs();
+    }
+
+    //A terminal gets the line editor, scripts and pipes are read with fgets
+    int interactive = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+    if (interactive) {
+        result = edit_line(prompt, cmd, sizeof(cmd));
+        if (result != NULL) {
+            add_history(cmd);
+        }
+    } else {
+        result = fgets(cmd, sizeof(cmd), stdin);
+    }
     if (result == NULL) {
         if(strlen(cmd) >= 1024){
             exit(0); 
         }
         
-        if(feof(stdin)){
+        if(feof(stdin) || interactive){
+            //Queued jobs still run before the shell exits
+            wait_queued_jobs();
             cleanup_stray_processes();
             exit(0);
         }else{
@@ -106,28 +825,88 @@ CmdSet parse_command(char *cmd) {
     
     //Starts with 0 commands
     CmdSet cmdset = { .num_commands = 0 };
+    MYSH_PROBE1(parse_start, cmd);
+    //Words of the previous line are no longer referenced
+    arena_reset();
+    line_generation++;
 
     //Splits input string into separate words
-    char **tokens = get_tokens(cmd);
+    char **line_tokens = get_tokens(cmd);
+    char **tokens = join_arithmetic_tokens(line_tokens);
+    expansion_failed = 0;
     //If no tokens...
     if(tokens[0] == NULL){
-        free_tokens(tokens);
+        free_tokens(line_tokens);
+        MYSH_PROBE1(parse_end, 0);
         return cmdset;
     }
 
     //Initialize cmd struct. Represents a single command
-    Cmd current_cmd = { .args = NULL, .input_file = NULL, .output_file = NULL, .append = 0, .background = 0 };
-    //Stores arguments of current command
-    char **args_buffer = malloc(MAX_ARGS * sizeof(char *));
+    Cmd current_cmd = { .args = NULL, .input_file = NULL, .output_file = NULL, .append = 0, .background = 0, .input_dup = -1, .output_dup = -1 };
+    //Stores arguments of current command, grown when globs expand past MAX_ARGS
+    int args_capacity = MAX_ARGS;
+    char **args_buffer = malloc(args_capacity * sizeof(char *));
     //Tracks number of arguments 
     int arg_index = 0;
+    BraceGen *braces;
+    const char *word;
+    //Set when an attribute is invalid; the line is not run without it
+    int rejected = 0;
+    //Set between '[[' and ']]'
+    int double_bracket = 0;
 
     //Iterates over arguments 
     for (int i = 0; tokens[i] != NULL; i++) {
         
-        if (strcmp(tokens[i], "&") == 0) {
+        if (i == 0 && strcmp(tokens[i], "perfstat") == 0 && tokens[1] != NULL) {
+            //Count the whole pipeline and report when it finishes
+            cmdset.perfstat = 1;
+        } else if (double_bracket || (arg_index == 0 && strcmp(tokens[i], "[[") == 0)) {
+            //Words of '[[ ... ]]' are only $-expanded: '<' and '>' compare strings, patterns are
+            //matched by the test itself, and a word expanding to nothing stays an empty operand
+            double_bracket = strcmp(tokens[i], "]]") != 0;
+            if (arg_index + 1 >= args_capacity) {
+                args_capacity *= 2;
+                args_buffer = realloc(args_buffer, args_capacity * sizeof(char *));
+            }
+            args_buffer[arg_index++] = (char *)expand_word(tokens[i]);
+        } else if (strcmp(tokens[i], "&") == 0) {
             //Command should be run in background
             current_cmd.background = 1;
+        } else if ((tokens[i][0] == '<' || tokens[i][0] == '>') && tokens[i][1] == '&') {
+            //'<&N' and '>&N' duplicate a descriptor the shell holds, such as a coprocess pipe
+            char direction = tokens[i][0];
+            const char *fd_word = tokens[i][2] != '\0' ? tokens[i] + 2 : tokens[++i];
+            if (fd_word == NULL) {
+                fprintf(stderr, "Error: Missing descriptor for redirection.\n");
+                break;
+            }
+            fd_word = expand_word(fd_word);
+            char *end;
+            long fd = strtol(fd_word, &end, 10);
+            if (*fd_word == '\0' || *end != '\0' || fd < 0 || fd > INT_MAX) {
+                fprintf(stderr, "Error: Bad descriptor for redirection: %s\n", fd_word);
+                break;
+            }
+            *(direction == '<' ? &current_cmd.input_dup : &current_cmd.output_dup) = fd;
+        } else if (strncmp(tokens[i], "->", 2) == 0 || strncmp(tokens[i], "=>", 2) == 0 || strncmp(tokens[i], "<-", 2) == 0) {
+            //Named streams: '->name' and '=>name' write to a stream, '<-name' reads from one
+            char direction = tokens[i][0];
+            const char *name = tokens[i][2] != '\0' ? tokens[i] + 2 : tokens[++i];
+            if (name == NULL) {
+                fprintf(stderr, "Error: Missing stream name.\n");
+                break;
+            }
+            if ((direction == '<' ? current_cmd.read_stream : current_cmd.write_stream) != NULL) {
+                fprintf(stderr, "Error: A command reads and writes at most one stream each.\n");
+                break;
+            }
+            if (direction == '<') {
+                current_cmd.read_stream = arena_strdup(name);
+            } else {
+                current_cmd.write_stream = arena_strdup(name);
+                current_cmd.write_atomic = direction == '=';
+            }
         } else if (strcmp(tokens[i], "<") == 0) {
             i++;
             //Next token must be input file name
@@ -136,7 +915,7 @@ CmdSet parse_command(char *cmd) {
                 break;
             }
             //Creates copy of input file name and stores it in current_cmd.input_file
-            current_cmd.input_file = strdup(tokens[i]);
+            current_cmd.input_file = (char *)expand_word(tokens[i]);
         } else if (strcmp(tokens[i], ">") == 0) {
             i++;
             //Next token must be input file name
@@ -144,7 +923,7 @@ CmdSet parse_command(char *cmd) {
                 fprintf(stderr, "Error: Missing filename for output redirection.\n");
                 break;
             }
-            current_cmd.output_file = strdup(tokens[i]);
+            current_cmd.output_file = (char *)expand_word(tokens[i]);
 
             //Overwrite operation
             current_cmd.append = 0;
@@ -154,24 +933,90 @@ CmdSet parse_command(char *cmd) {
                 fprintf(stderr, "Error: Missing filename for output redirection.\n");
                 break;
             }
-            current_cmd.output_file = strdup(tokens[i]);
+            current_cmd.output_file = (char *)expand_word(tokens[i]);
 
             //Indicates data should be appended to the file instead of overwriting it
             current_cmd.append = 1;
+        } else if (arg_index == 0 && is_assignment(tokens[i])) {
+            //Assignments before the command name set variables, or its environment
+            int count = 0;
+            while (current_cmd.assignments != NULL && current_cmd.assignments[count] != NULL) count++;
+            current_cmd.assignments = realloc(current_cmd.assignments, (count + 2) * sizeof(char *));
+            current_cmd.assignments[count] = (char *)expand_word(tokens[i]);
+            current_cmd.assignments[count + 1] = NULL;
+        } else if (tokens[i][0] == '@' && arg_index == 0) {
+            //Per-command attribute placed before the command name
+            if (parse_attribute(&current_cmd, tokens[i]) < 0) {
+                rejected = 1;
+                break;
+            }
         } else if (strcmp(tokens[i], "|") == 0) {
             args_buffer[arg_index] = NULL;
             current_cmd.args = malloc((arg_index + 1) * sizeof(char *));
             memcpy(current_cmd.args, args_buffer, (arg_index + 1) * sizeof(char *));
             cmdset.commands[cmdset.num_commands++] = current_cmd;
 
-            current_cmd = (Cmd) { .args = NULL, .input_file = NULL, .output_file = NULL, .append = 0, .background = 0 };
+            current_cmd = (Cmd) { .args = NULL, .input_file = NULL, .output_file = NULL, .append = 0, .background = 0, .input_dup = -1, .output_dup = -1 };
             arg_index = 0;
-        } else {
-            args_buffer[arg_index++] = strdup(tokens[i]);
+        } else if (strchr(tokens[i], '{') != NULL && (braces = parse_braces(tokens[i])) != NULL) {
+            //Braces are expanded as written, before '$', so a variable's value is never brace
+            //expanded. Expansions that would not fit in one argv are left to the batching
+            //executor, which streams one of them per command
+            unsigned long long bytes;
+            if (__builtin_mul_overflow(braces->total, braces->max_len + 1 + sizeof(char *), &bytes)) {
+                bytes = ULLONG_MAX;
+            }
+            if (bytes > (unsigned long long)sysconf(_SC_ARG_MAX) / 2) {
+                if (current_cmd.stream != NULL) {
+                    fprintf(stderr, "Error: Only one brace expansion per command may exceed ARG_MAX.\n");
+                    free_braces(braces);
+                    rejected = 1;
+                    break;
+                }
+                current_cmd.stream = braces;
+                current_cmd.stream_at = arg_index;
+                continue;
+            }
+            char brace_word[MAX_CMD_LENGTH];
+            while (next_brace_word(braces, brace_word, sizeof(brace_word)) >= 0) {
+                word = expand_word(brace_word);
+                if ((word[0] == '\0' && strchr(brace_word, '$') != NULL) ||
+                    (has_glob(word) && expand_glob(word, &args_buffer, &arg_index, &args_capacity) > 0)) {
+                    continue;
+                }
+                if (arg_index + 1 >= args_capacity) {
+                    args_capacity *= 2;
+                    args_buffer = realloc(args_buffer, args_capacity * sizeof(char *));
+                }
+                args_buffer[arg_index++] = (char *)word;
+            }
+            free_braces(braces);
+        } else if ((word = expand_word(tokens[i]))[0] == '\0' && strchr(tokens[i], '$') != NULL) {
+            //An expansion to nothing leaves no word behind
+            continue;
+        } else if (!has_glob(word) || expand_glob(word, &args_buffer, &arg_index, &args_capacity) == 0) {
+            //A word without matches is kept as written
+            if (arg_index + 1 >= args_capacity) {
+                args_capacity *= 2;
+                args_buffer = realloc(args_buffer, args_capacity * sizeof(char *));
+            }
+            args_buffer[arg_index++] = (char *)word;
         }
     }
 
-    if (arg_index > 0) {
+    if (rejected || expansion_failed) {
+        for (int c = 0; c < cmdset.num_commands; c++) {
+            free(cmdset.commands[c].args);
+            if (cmdset.commands[c].stream != NULL) {
+                free_braces(cmdset.commands[c].stream);
+            }
+        }
+        if (current_cmd.stream != NULL) {
+            free_braces(current_cmd.stream);
+        }
+        cmdset.num_commands = 0;
+        last_status = rejected ? 2 : 1;
+    } else if (arg_index > 0 || (cmdset.num_commands == 0 && current_cmd.assignments != NULL)) {
         args_buffer[arg_index] = NULL;
         current_cmd.args = malloc((arg_index + 1) * sizeof(char *));
         memcpy(current_cmd.args, args_buffer, (arg_index + 1) * sizeof(char *));
@@ -179,7 +1024,8 @@ CmdSet parse_command(char *cmd) {
     }
 
     free(args_buffer);
-    free_tokens(tokens);
+    free_tokens(line_tokens);
+    MYSH_PROBE1(parse_end, cmdset.num_commands);
     return cmdset;
 }
 
@@ -189,9 +1035,120 @@ void execute_commands(CmdSet *cmdset) {
     int input_fd = STDIN_FILENO;
     //Holds fds used for piping between processes
     int pipe_fd[2];
-    
-    //Iterates over each command in the command set 
+
+    //A line of only assignments sets shell variables
+    Cmd *first = &cmdset->commands[0];
+    if (cmdset->num_commands == 1 && first->args != NULL && first->args[0] == NULL && first->assignments != NULL) {
+        for (int i = 0; first->assignments[i] != NULL; i++) {
+            char *equals = strchr(first->assignments[i], '=');
+            *equals = '\0';
+            set_variable(first->assignments[i], equals + 1, 0);
+            *equals = '=';
+        }
+        last_status = 0;
+        return;
+    }
+
+    //Lines with named streams are checked before anything starts
+    int graph = check_streams(cmdset);
+    if (graph < 0) {
+        last_status = 2;
+        return;
+    }
+    //Only an exec'd command can be run once per batch of a streamed expansion
     for (int i = 0; i < cmdset->num_commands; i++) {
+        Cmd *cmd = &cmdset->commands[i];
+        if (cmd->stream != NULL && cmd->args[0] != NULL && find_builtin(cmd->args[0]) != NULL) {
+            fprintf(stderr, "Error: %s: Brace expansion too large for a builtin.\n", cmd->args[0]);
+            last_status = 2;
+            return;
+        }
+    }
+
+    //Commands get the environment prebuilt here, not per exec
+    current_envp();
+
+    //A lone foreground builtin runs inside the shell, redirected ones included, so 'read x < file'
+    //sets x. xargs starts commands, so it runs as a job for its batches to share the job's
+    //cgroup, counters and CPUs
+    if (cmdset->num_commands == 1 && !first->background && first->args != NULL && first->args[0] != NULL) {
+        const Builtin *builtin = find_builtin(first->args[0]);
+        if (builtin != NULL && builtin->fn != builtin_xargs) {
+            last_status = replay_stub ? 0 : run_builtin_redirected(builtin, first);
+            return;
+        }
+    }
+
+    //A trailing '&' puts every stage of the pipeline in the background
+    int background = 0;
+    for (int i = 0; i < cmdset->num_commands; i++) {
+        background |= cmdset->commands[i].background;
+    }
+    for (int i = 0; i < cmdset->num_commands; i++) {
+        cmdset->commands[i].background = background;
+    }
+
+    //Background jobs wait in a queue while the host is under pressure
+    if (background && !admit_background_job()) {
+        if (num_queued_jobs == MAX_QUEUED_JOBS) {
+            fprintf(stderr, "Error: Too many queued jobs.\n");
+            return;
+        }
+        //The words live in the line arena, which the next line reuses
+        queued_jobs[num_queued_jobs++] = copy_cmdset(cmdset);
+        printf("[Queued job %d]\n", num_queued_jobs);
+        return;
+    }
+
+    //Choose the CPUs each stage is pinned to
+    place_pipeline(cmdset);
+
+    //Hold SIGCHLD until every PID is recorded in the job table
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old_mask);
+    current_job = create_job(cmdset);
+    if (background) {
+        last_status = 0;
+    } else {
+        foreground_job = current_job;
+    }
+    if (current_job != NULL && cgroup_enabled) {
+        create_job_cgroup(current_job, cmdset);
+    }
+    if (current_job != NULL) {
+        current_job->perf = cmdset->perfstat ? PERF_REPORT : (perf_accounting ? PERF_COUNT : PERF_OFF);
+    }
+    
+    //In parallel mode every pipe exists before the first fork. A line with streams is
+    //always started this way, since its stages do not form a chain
+    int parallel = graph || (spawn_parallel && cmdset->num_commands > 1);
+    int stage_input[MAX_CMDS], stage_output[MAX_CMDS];
+    if (parallel && wire_pipeline(cmdset, stage_input, stage_output) < 0) {
+        //Without its pipes a graph cannot run at all; a chain falls back to serial startup
+        if (graph) {
+            last_status = 1;
+            current_job = NULL;
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            return;
+        }
+        parallel = 0;
+    }
+
+    //Iterates over each command in the command set. Every stage is forked before any exec
+    //status is read, or a stage blocked before exec (say, opening a FIFO another stage opens)
+    //would stop the rest from starting. Background stages are confirmed at the next prompt
+    defer_exec_status = !background;
+    for (int i = 0; parallel && i < cmdset->num_commands; i++) {
+        execute_single_command(&cmdset->commands[i], stage_input[i], stage_output[i]);
+    }
+    for (int i = 0; i < num_pipeline_fds; i++) {
+        close(pipeline_fds[i]);
+    }
+    num_pipeline_fds = 0;
+
+    for (int i = 0; !parallel && i < cmdset->num_commands; i++) {
         
         //Account for long pipeline
         if (i >= 128) {
@@ -208,14 +1165,20 @@ void execute_commands(CmdSet *cmdset) {
         //Setup pipe if necessary. Checks if current command is not the last comment in the set
         if (i < cmdset->num_commands - 1) {
             //If true, creates a pipe. pipe_fd[0] for reading and pipe[1] for writing.
-            if (pipe(pipe_fd) < 0) {
+            //Close-on-exec keeps the writer from holding the read end open
+            if (pipe2(pipe_fd, O_CLOEXEC) < 0) {
                 perror("Error creating pipe");
-                return;
+                break;
             }
         }
 
-        //Executes the command. cmd is the current command.
+        //Executes the command. cmd is the current command. A builtin child never execs, so it is
+        //told to close the next stage's read end, or that stage would never see a broken pipe
+        if (i < cmdset->num_commands - 1) {
+            pipeline_fds[num_pipeline_fds++] = pipe_fd[0];
+        }
         execute_single_command(cmd, input_fd, i < cmdset->num_commands - 1 ? pipe_fd[1] : STDOUT_FILENO);
+        num_pipeline_fds = 0;
 
         if (input_fd != STDIN_FILENO) {
             close(input_fd);
@@ -228,6 +1191,11 @@ void execute_commands(CmdSet *cmdset) {
             input_fd = pipe_fd[0];
         }
     }
+    defer_exec_status = 0;
+    wait_pending_execs();
+
+    current_job = NULL;
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
 }
 
 //Execute a single command
@@ -237,11 +1205,36 @@ void execute_single_command(Cmd *cmd, int input_fd, int output_fd) {
         return;  
     }
     
-    //Creates a child process 
-    pid_t pid = fork();
+    //Counted children wait on this pipe until their counters are attached
+    int sync_pipe[2] = { -1, -1 };
+    if (current_job != NULL && current_job->perf != PERF_OFF && pipe2(sync_pipe, O_CLOEXEC) < 0) {
+        perror("Error creating pipe");
+        sync_pipe[0] = sync_pipe[1] = -1;
+    }
+
+    //The child writes its exec errno here; a successful exec closes it with nothing written
+    int exec_pipe[2];
+    if (pipe2(exec_pipe, O_CLOEXEC) < 0) {
+        perror("Error creating pipe");
+        exec_pipe[0] = exec_pipe[1] = -1;
+    }
+
+    //Creates a child process, inside the job's cgroup when it has one
+    pid_t pid = spawn_process(current_job != NULL ? current_job->cgroup_fd : -1);
 
     //Child process
     if (pid == 0) { 
+        if (exec_pipe[0] >= 0) {
+            close(exec_pipe[0]);
+        }
+        if (sync_pipe[0] >= 0) {
+            char c;
+            close(sync_pipe[1]);
+            while (read(sync_pipe[0], &c, 1) < 0 && errno == EINTR);
+            close(sync_pipe[0]);
+        }
+        setup_child(cmd);
+
         setup_redirection(cmd);
 
         if (input_fd != STDIN_FILENO) {
@@ -254,32 +1247,180 @@ void execute_single_command(Cmd *cmd, int input_fd, int output_fd) {
             dup2(output_fd, STDOUT_FILENO);
             close(output_fd);
         }
+        //Builtins never exec, so drop the other stages' pipe ends and the shell's coprocess
+        //pipes explicitly, or a coprocess would never see end of file
+        for (int i = 0; i < num_pipeline_fds; i++) {
+            close(pipeline_fds[i]);
+        }
+        close_coproc_fds();
+
+        //Batches and builtins never exec; close the status pipe so the shell does not wait
+        //for them to finish before starting the next stage
+        if (exec_pipe[1] >= 0 && (cmd->stream != NULL || find_builtin(cmd->args[0]) != NULL)) {
+            close(exec_pipe[1]);
+            exec_pipe[1] = -1;
+        }
+
+        //A streamed brace expansion runs the command once per ARG_MAX-sized batch
+        if (cmd->stream != NULL) {
+            signal(SIGCHLD, SIG_DFL);
+            int num_args = 0;
+            while (cmd->args[num_args] != NULL) num_args++;
+            Batcher batch;
+            if (batch_init(&batch, cmd->args, cmd->stream_at, cmd->args + cmd->stream_at, num_args - cmd->stream_at, 1) < 0) {
+                _exit(1);
+            }
+            //Each word is expanded like a parsed one, then dropped from the arena once batched
+            char word[MAX_CMD_LENGTH];
+            size_t chunk = line_arena.current, used = line_arena.used;
+            while (next_brace_word(cmd->stream, word, sizeof(word)) >= 0) {
+                const char *expanded = expand_word(word);
+                if (expanded[0] != '\0' || strchr(word, '$') == NULL) {
+                    batch_add(&batch, expanded);
+                }
+                line_arena.current = chunk;
+                line_arena.used = used;
+            }
+            _exit(batch_finish(&batch));
+        }
+
+        //Builtins in a pipeline or in the background run in the child
+        const Builtin *builtin = find_builtin(cmd->args[0]);
+        if (builtin != NULL) {
+            int status = builtin->fn(cmd->args);
+            fflush(stdout);
+            _exit(status);
+        }
+
+        //Assignments before the command only change its own environment
+        char **envp = cached_envp;
+        for (int i = 0; cmd->assignments != NULL && cmd->assignments[i] != NULL; i++) {
+            putenv(cmd->assignments[i]);
+            envp = environ;
+        }
 
         //Replaces current process with new process
-        execvp(cmd->args[0], cmd->args);
+        execvpe(cmd->args[0], cmd->args, envp);
+        int exec_errno = errno;
+        MYSH_PROBE2(exec_failed, cmd->args[0], exec_errno);
+        //Never return into the shell's loop; the parent reports the error
+        if (exec_pipe[1] < 0 || write(exec_pipe[1], &exec_errno, sizeof(exec_errno)) != sizeof(exec_errno)) {
+            fprintf(stderr, "Error: %s: %s\n", cmd->args[0], strerror(exec_errno));
+        }
+        _exit(exec_errno == ENOENT ? 127 : 126);
 
     //Parent process 
     } else if(pid > 0){ 
+        MYSH_PROBE3(spawn, pid, cmd->args[0], current_job != NULL ? current_job->id : 0);
+        if (current_job != NULL && current_job->num_pids < MAX_CMDS) {
+            current_job->pids[current_job->num_pids++] = pid;
+            current_job->num_running++;
+            if (sync_pipe[0] >= 0) {
+                open_perf_counters(current_job, current_job->num_pids - 1, pid);
+            }
+        }
+        if (sync_pipe[0] >= 0) {
+            //Closing the write end releases the child
+            close(sync_pipe[0]);
+            close(sync_pipe[1]);
+        }
+        if (exec_pipe[0] >= 0) {
+            close(exec_pipe[1]);
+            if (defer_exec_status) {
+                //A foreground pipeline confirms every stage's exec after the last fork
+                pending_execs[num_pending_execs++] = (PendingExec) { .fd = exec_pipe[0], .name = cmd->args[0] };
+            } else if (cmd->background && num_background_execs < MAX_BACKGROUND_EXECS) {
+                background_execs[num_background_execs++] = (PendingExec) { .fd = exec_pipe[0], .name = strdup(cmd->args[0]) };
+            } else {
+                report_exec_status(exec_pipe[0], cmd->args[0]);
+            }
+        }
         if(!cmd->background) {
             //Child process runs in foreground
             foreground_pids[num_foreground_pids++] = pid;
         }else{
             printf("[Background PID %d]\n", pid);
+            last_background_pid = pid;
         }
     } else{
         perror("fork failed");
+        if (exec_pipe[0] >= 0) {
+            close(exec_pipe[0]);
+            close(exec_pipe[1]);
+        }
+        if (sync_pipe[0] >= 0) {
+            close(sync_pipe[0]);
+            close(sync_pipe[1]);
+        }
+    }
+}
+
+//Setup shared by every child that runs a command, pipeline stages and xargs batches alike:
+//restore SIGCHLD, stop here under --stub before anything is opened, then apply the command's
+//CPUs and scheduling. The job's cgroup and perf counters are set up by the parent
+void setup_child(const Cmd *cmd) {
+    //Children must not inherit the shell's blocked SIGCHLD
+    sigset_t unblock;
+    sigemptyset(&unblock);
+    sigaddset(&unblock, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &unblock, NULL);
+
+    //Replays that measure the shell's own overhead skip the real work, redirections
+    //included, so a stubbed replay never touches a file
+    if (replay_stub) {
+        _exit(0);
+    }
+    child_cmd = cmd;
+    if (cmd == NULL) {
+        return;
+    }
+
+    if (cmd->has_affinity && sched_setaffinity(0, sizeof(cmd->affinity), &cmd->affinity) < 0) {
+        fprintf(stderr, "Error: sched_setaffinity: %s\n", strerror(errno));
     }
+
+    //Background jobs fall back to the 'sched' defaults for unset fields
+    SchedAttrs attrs = cmd->sched;
+    if (cmd->background) {
+        int inherited = background_sched.set & ~attrs.set;
+        SchedAttrs defaults = background_sched;
+        if (inherited & SCHED_SET_NICE) attrs.nice = defaults.nice;
+        if (inherited & SCHED_SET_POLICY) attrs.policy = defaults.policy;
+        if (inherited & SCHED_SET_IOPRIO) attrs.ioprio = defaults.ioprio;
+        if (inherited & SCHED_SET_LIMIT_AS) attrs.limit_as = defaults.limit_as;
+        if (inherited & SCHED_SET_LIMIT_NOFILE) attrs.limit_nofile = defaults.limit_nofile;
+        if (inherited & SCHED_SET_LIMIT_CPU) attrs.limit_cpu = defaults.limit_cpu;
+        attrs.set |= inherited;
+    }
+    apply_sched_attrs(&attrs);
 }
 
-//Setup input/output redirection
+//Setup input/output redirection in a child, which exits if it fails
 void setup_redirection(Cmd *cmd){
+    if (apply_redirection(cmd) < 0) {
+        exit(1);
+    }
+}
+
+//Point stdin and stdout at the command's redirections. Returns -1 after reporting a failure
+int apply_redirection(Cmd *cmd) {
+    //Descriptors named with '<&N' and '>&N'; dup2 clears their close-on-exec flag
+    if (cmd->input_dup >= 0 && cmd->input_dup != STDIN_FILENO && dup2(cmd->input_dup, STDIN_FILENO) < 0) {
+        fprintf(stderr, "Error: <&%d: %s\n", cmd->input_dup, strerror(errno));
+        return -1;
+    }
+    if (cmd->output_dup >= 0 && cmd->output_dup != STDOUT_FILENO && dup2(cmd->output_dup, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "Error: >&%d: %s\n", cmd->output_dup, strerror(errno));
+        return -1;
+    }
+
     //Checks if command has an input file specified 
     if(cmd->input_file){
         //Opens the file in read mode 
-        int fd = open(cmd->input_file, O_RDONLY);
+        int fd = open(cmd->input_file, O_RDONLY | O_CLOEXEC);
         if(fd < 0){
             fprintf(stderr, "Error: open(\"%s\"): %s\n", cmd->input_file, strerror(errno));
-            exit(0);
+            return -1;
         }
         dup2(fd, STDIN_FILENO);
         close(fd);
@@ -287,49 +1428,63 @@ void setup_redirection(Cmd *cmd){
 
     //Checks if command has an output file specified
     if(cmd->output_file){
-        int fd = open(cmd->output_file, O_WRONLY | O_CREAT | (cmd->append ? O_APPEND : O_TRUNC), S_IRUSR | S_IWUSR);
+        int fd = open(cmd->output_file, O_WRONLY | O_CREAT | O_CLOEXEC | (cmd->append ? O_APPEND : O_TRUNC), S_IRUSR | S_IWUSR);
         if(fd < 0){
             fprintf(stderr, "Error: open(\"%s\"): %s\n", cmd->output_file, strerror(errno));
-            exit(0);
+            return -1;
         }
         dup2(fd, STDOUT_FILENO);
         close(fd);
     }
+    return 0;
+}
+
+//Run a builtin inside the shell with the command's redirections. The shell's stdin and stdout
+//are saved first when redirected and put back afterwards. Returns the builtin's status
+int run_builtin_redirected(const Builtin *builtin, Cmd *cmd) {
+    int redirect_in = cmd->input_file != NULL || cmd->input_dup >= 0;
+    int redirect_out = cmd->output_file != NULL || cmd->output_dup >= 0;
+    if (!redirect_in && !redirect_out) {
+        return builtin->fn(cmd->args);
+    }
+    fflush(stdout);
+    int saved_in = redirect_in ? fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10) : -1;
+    int saved_out = redirect_out ? fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10) : -1;
+    int status = 1;
+    if (apply_redirection(cmd) == 0) {
+        //'read <&$NAME_OUT' goes through the coprocess's buffer like 'read -u'
+        builtin_input_dup = cmd->input_dup;
+        status = builtin->fn(cmd->args);
+        builtin_input_dup = -1;
+    }
+    fflush(stdout);
+
+    //A descriptor the shell did not have open is closed again
+    if (redirect_in && (saved_in < 0 ? close(STDIN_FILENO) : dup2(saved_in, STDIN_FILENO)) >= 0 && saved_in >= 0) {
+        close(saved_in);
+    }
+    if (redirect_out && (saved_out < 0 ? close(STDOUT_FILENO) : dup2(saved_out, STDOUT_FILENO)) >= 0 && saved_out >= 0) {
+        close(saved_out);
+    }
+    return status;
 }
 
 //Wait for all foreground processes to terminate
 void handle_foreground_pids() {
-    //Stores status info of a terminated child process
-    int status;
-    //Stores the pid of the terminated process returned by wait()
-    pid_t pid;
+    //Block SIGCHLD so an exit cannot slip in between the check and the wait
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old_mask);
 
-    //Wait for each foreground process
+    //Wait for each foreground process. signal_handler removes them as they exit
+    MYSH_PROBE1(foreground_wait, num_foreground_pids);
     while (num_foreground_pids > 0) {
-        //Wait for any child process to terminate
-        pid = wait(&status);  
-        if (pid == -1) {
-            if (errno == ECHILD) {
-                //No more children to wait for
-                break;
-            } else {
-                perror("wait failed");
-                break;
-            }
-        }
-
-        //Check if the terminated child was a foreground process
-        for(int i = 0; i < num_foreground_pids; i++){
-            if(foreground_pids[i] == pid){
-                //Shift remaining PIDs left in the array
-                for(int j = i; j < num_foreground_pids - 1; j++){
-                    foreground_pids[j] = foreground_pids[j + 1];
-                }
-                num_foreground_pids--;
-                break;
-            }
-        }
+        sigsuspend(&old_mask);
     }
+    MYSH_PROBE0(foreground_done);
+
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
 }
 
 // Cleanup any stray processes before exiting the shell
@@ -341,9 +1496,5651 @@ void cleanup_stray_processes() {
 // Handle terminated background processes
 void signal_handler(int signo) {
     if (signo == SIGCHLD) {
-        int status;
-        while (wait3(&status, WNOHANG, NULL) > 0);
+        int saved_errno = errno;
+        reap_children();
+        errno = saved_errno;
+    }
+}
+
+//Reap every exited child and record it in the job table
+void reap_children() {
+    int status;
+    pid_t pid;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        record_exit(pid, status, &usage);
     }
 }
 
+//Remove an exited child from the foreground PIDs and its job
+void record_exit(pid_t pid, int status, struct rusage *usage) {
+    MYSH_PROBE2(child_exit, pid, status);
+    for (int i = 0; i < num_foreground_pids; i++) {
+        if (foreground_pids[i] == pid) {
+            //Shift remaining PIDs left in the array
+            for (int j = i; j < num_foreground_pids - 1; j++) {
+                foreground_pids[j] = foreground_pids[j + 1];
+            }
+            num_foreground_pids--;
+            break;
+        }
+    }
 
+    for (int i = 0; i < MAX_JOBS; i++) {
+        Job *job = &jobs[i];
+        if (job->id == 0) {
+            continue;
+        }
+        for (int j = 0; j < job->num_pids; j++) {
+            if (job->pids[j] == pid) {
+                job->num_running--;
+                timeradd(&job->usage.ru_utime, &usage->ru_utime, &job->usage.ru_utime);
+                timeradd(&job->usage.ru_stime, &usage->ru_stime, &job->usage.ru_stime);
+                if (usage->ru_maxrss > job->usage.ru_maxrss) {
+                    job->usage.ru_maxrss = usage->ru_maxrss;
+                }
+                if (j == job->num_pids - 1) {
+                    job->status = status;
+                }
+                if (job->num_running == 0) {
+                    clock_gettime(CLOCK_MONOTONIC, &job->finished);
+                }
+                if (job->perf != PERF_OFF) {
+                    read_perf_counters(job, j);
+                }
+                return;
+            }
+        }
+    }
+}
+
+//Take a job slot for a pipeline. Slots of finished jobs are reused
+Job *create_job(CmdSet *cmdset) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        Job *job = &jobs[i];
+        if (job->id != 0 && (job->num_running > 0 || !job->collected)) {
+            continue;
+        }
+        *job = (Job) { .id = next_job_id++, .cgroup_fd = -1 };
+        memset(job->perf_fds, -1, sizeof(job->perf_fds));
+        clock_gettime(CLOCK_MONOTONIC, &job->started);
+
+        //Rebuild the command line from the parsed commands
+        size_t len = 0;
+        for (int c = 0; c < cmdset->num_commands; c++) {
+            Cmd *cmd = &cmdset->commands[c];
+            job->background |= cmd->background;
+            for (int a = 0; cmd->args != NULL && cmd->args[a] != NULL && len < sizeof(job->cmdline); a++) {
+                len += snprintf(job->cmdline + len, sizeof(job->cmdline) - len, "%s%s",
+                                (c > 0 && a == 0) ? " | " : (len > 0 ? " " : ""), cmd->args[a]);
+            }
+        }
+        return job;
+    }
+    return NULL;
+}
+
+//Count background jobs that are still running
+int count_background_jobs() {
+    int count = 0;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id != 0 && jobs[i].background && jobs[i].num_running > 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+//Read 'some avg10' from /proc/pressure/<resource>. Returns 0 if PSI is unavailable
+double read_pressure(const char *resource) {
+    char path[64], buf[256];
+    snprintf(path, sizeof(path), "/proc/pressure/%s", resource);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+
+    double avg10 = 0;
+    char *field = strstr(buf, "some avg10=");
+    if (field != NULL) {
+        avg10 = strtod(field + strlen("some avg10="), NULL);
+    }
+    return avg10;
+}
+
+//Check whether a background job may start now
+int admit_background_job() {
+    if (admission.max_jobs > 0 && count_background_jobs() >= admission.max_jobs) {
+        return 0;
+    }
+    if (admission.cpu > 0 && read_pressure("cpu") > admission.cpu) {
+        return 0;
+    }
+    if (admission.memory > 0 && read_pressure("memory") > admission.memory) {
+        return 0;
+    }
+    if (admission.io > 0 && read_pressure("io") > admission.io) {
+        return 0;
+    }
+    return 1;
+}
+
+//Start queued background jobs in order while admission allows it. $? still belongs to the
+//last line the user ran
+void release_queued_jobs() {
+    int status = last_status;
+    while (num_queued_jobs > 0 && admit_background_job()) {
+        CmdSet cmdset = queued_jobs[0];
+        num_queued_jobs--;
+        memmove(&queued_jobs[0], &queued_jobs[1], num_queued_jobs * sizeof(CmdSet));
+        execute_commands(&cmdset);
+        free_cmdset(&cmdset);
+    }
+    last_status = status;
+}
+
+//Start every queued job before the shell exits. A job exiting may free a slot, so the
+//shell sleeps until SIGCHLD; pressure limits are rechecked each second, since PSI gives
+//no notice when pressure falls
+void wait_queued_jobs() {
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old_mask);
+    release_queued_jobs();
+    while (num_queued_jobs > 0) {
+        struct timespec second = { 1, 0 };
+        int pressure = admission.cpu > 0 || admission.memory > 0 || admission.io > 0;
+        ppoll(NULL, 0, pressure ? &second : NULL, &old_mask);
+        release_queued_jobs();
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+//admission [off | on | cpu=N memory=N io=N jobs=N]: queue background jobs under pressure
+int builtin_admission(char **args) {
+    if (args[1] == NULL) {
+        printf("admission: cpu=%g memory=%g io=%g jobs=%d\n", admission.cpu, admission.memory,
+               admission.io, admission.max_jobs);
+        printf("pressure: cpu=%.2f memory=%.2f io=%.2f, %d running, %d queued\n", read_pressure("cpu"),
+               read_pressure("memory"), read_pressure("io"), count_background_jobs(), num_queued_jobs);
+        return 0;
+    }
+
+    Admission updated = admission;
+    for (int i = 1; args[i] != NULL; i++) {
+        char *end = NULL;
+        if (strcmp(args[i], "off") == 0) {
+            updated = (Admission) { 0, 0, 0, 0 };
+            continue;
+        } else if (strcmp(args[i], "on") == 0) {
+            updated = (Admission) { .cpu = 80, .memory = 10, .io = 50, .max_jobs = 0 };
+            continue;
+        } else if (strncmp(args[i], "cpu=", 4) == 0) {
+            updated.cpu = strtod(args[i] + 4, &end);
+        } else if (strncmp(args[i], "memory=", 7) == 0) {
+            updated.memory = strtod(args[i] + 7, &end);
+        } else if (strncmp(args[i], "io=", 3) == 0) {
+            updated.io = strtod(args[i] + 3, &end);
+        } else if (strncmp(args[i], "jobs=", 5) == 0) {
+            updated.max_jobs = strtol(args[i] + 5, &end, 10);
+        }
+        if (end == NULL || *end != '\0') {
+            fprintf(stderr, "Error: Usage: admission [off | on | cpu=N memory=N io=N jobs=N]\n");
+            return 1;
+        }
+    }
+    admission = updated;
+    return 0;
+}
+
+//Look up a builtin by name
+const Builtin *find_builtin(const char *name) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+//Parse a per-command '@name=value' attribute. Returns 0 on success
+int parse_attribute(Cmd *cmd, const char *token) {
+    const char *value = strchr(token, '=');
+    if (value == NULL) {
+        fprintf(stderr, "Error: Attribute %s needs a value.\n", token);
+        return -1;
+    }
+    size_t name_len = value - token - 1;
+    value++;
+
+    #define ATTRIBUTE(name) (name_len == strlen(name) && strncmp(token + 1, name, name_len) == 0)
+    if (ATTRIBUTE("cpus")) {
+        cpu_set_t set;
+        if (parse_cpu_list(value, &set) < 0) {
+            fprintf(stderr, "Error: Invalid CPU list \"%s\".\n", value);
+            return -1;
+        }
+        cmd->cpus = strdup(value);
+        return 0;
+    }
+
+    //cgroup limits keep the kernel's syntax, with ':' and ',' standing in for spaces
+    if (ATTRIBUTE("memory.max") || ATTRIBUTE("cpu.max") || ATTRIBUTE("io.max")) {
+        char *limit = strdup(value);
+        rlim_t bytes;
+        if (ATTRIBUTE("memory.max") && parse_size(value, &bytes) == 0) {
+            char number[32];
+            snprintf(number, sizeof(number), "%llu", (unsigned long long)bytes);
+            free(limit);
+            limit = strdup(number);
+        }
+        for (char *c = limit; *c != '\0'; c++) {
+            if (*c == ',' || (*c == ':' && ATTRIBUTE("cpu.max"))) {
+                *c = ' ';
+            }
+        }
+        if (ATTRIBUTE("memory.max")) {
+            cmd->limits.memory_max = limit;
+        } else if (ATTRIBUTE("cpu.max")) {
+            cmd->limits.cpu_max = limit;
+        } else {
+            cmd->limits.io_max = limit;
+        }
+        return 0;
+    }
+
+    SchedAttrs *attrs = &cmd->sched;
+    char *end;
+    if (ATTRIBUTE("nice")) {
+        long nice = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || nice < -20 || nice > 19) {
+            fprintf(stderr, "Error: Nice level must be between -20 and 19.\n");
+            return -1;
+        }
+        attrs->nice = nice;
+        attrs->set |= SCHED_SET_NICE;
+    } else if (ATTRIBUTE("sched")) {
+        if (strcmp(value, "other") == 0) {
+            attrs->policy = SCHED_OTHER;
+        } else if (strcmp(value, "batch") == 0) {
+            attrs->policy = SCHED_BATCH;
+        } else if (strcmp(value, "idle") == 0) {
+            attrs->policy = SCHED_IDLE;
+        } else {
+            fprintf(stderr, "Error: Scheduling class must be other, batch or idle.\n");
+            return -1;
+        }
+        attrs->set |= SCHED_SET_POLICY;
+    } else if (ATTRIBUTE("ioprio")) {
+        //CLASS[:LEVEL] with class rt, be or idle and level 0 (highest) to 7
+        int class;
+        long level = 4;
+        if (strncmp(value, "rt", 2) == 0) {
+            class = 1, end = (char *)value + 2;
+        } else if (strncmp(value, "be", 2) == 0) {
+            class = 2, end = (char *)value + 2;
+        } else if (strncmp(value, "idle", 4) == 0) {
+            class = 3, end = (char *)value + 4, level = 0;
+        } else {
+            fprintf(stderr, "Error: I/O class must be rt, be or idle.\n");
+            return -1;
+        }
+        if (*end == ':') {
+            char *level_text = end + 1;
+            level = strtol(level_text, &end, 10);
+            if (end == level_text || level < 0 || level > 7) {
+                fprintf(stderr, "Error: I/O priority level must be between 0 and 7.\n");
+                return -1;
+            }
+        }
+        if (*end != '\0') {
+            fprintf(stderr, "Error: Invalid I/O priority \"%s\".\n", value);
+            return -1;
+        }
+        attrs->ioprio = (class << 13) | level;
+        attrs->set |= SCHED_SET_IOPRIO;
+    } else if (ATTRIBUTE("limit-as") || ATTRIBUTE("limit-nofile") || ATTRIBUTE("limit-cpu")) {
+        rlim_t limit;
+        if (parse_size(value, &limit) < 0) {
+            fprintf(stderr, "Error: Invalid limit \"%s\".\n", value);
+            return -1;
+        }
+        if (ATTRIBUTE("limit-as")) {
+            attrs->limit_as = limit;
+            attrs->set |= SCHED_SET_LIMIT_AS;
+        } else if (ATTRIBUTE("limit-nofile")) {
+            attrs->limit_nofile = limit;
+            attrs->set |= SCHED_SET_LIMIT_NOFILE;
+        } else {
+            attrs->limit_cpu = limit;
+            attrs->set |= SCHED_SET_LIMIT_CPU;
+        }
+    } else {
+        fprintf(stderr, "Error: Unknown attribute %s.\n", token);
+        return -1;
+    }
+    #undef ATTRIBUTE
+    return 0;
+}
+
+//Parse a number with an optional K, M or G suffix. Returns 0 on success
+int parse_size(const char *text, rlim_t *size) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) {
+        return -1;
+    }
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
+
+//Apply scheduling attributes to the calling process
+void apply_sched_attrs(const SchedAttrs *attrs) {
+    if ((attrs->set & SCHED_SET_NICE) && setpriority(PRIO_PROCESS, 0, attrs->nice) < 0) {
+        fprintf(stderr, "Error: setpriority: %s\n", strerror(errno));
+    }
+    if (attrs->set & SCHED_SET_POLICY) {
+        struct sched_param param = { .sched_priority = 0 };
+        if (sched_setscheduler(0, attrs->policy, &param) < 0) {
+            fprintf(stderr, "Error: sched_setscheduler: %s\n", strerror(errno));
+        }
+    }
+    //IOPRIO_WHO_PROCESS is 1; glibc has no wrapper for ioprio_set
+    if ((attrs->set & SCHED_SET_IOPRIO) && syscall(SYS_ioprio_set, 1, 0, attrs->ioprio) < 0) {
+        fprintf(stderr, "Error: ioprio_set: %s\n", strerror(errno));
+    }
+
+    struct { int set; int resource; rlim_t value; const char *name; } limits[] = {
+        { SCHED_SET_LIMIT_AS, RLIMIT_AS, attrs->limit_as, "RLIMIT_AS" },
+        { SCHED_SET_LIMIT_NOFILE, RLIMIT_NOFILE, attrs->limit_nofile, "RLIMIT_NOFILE" },
+        { SCHED_SET_LIMIT_CPU, RLIMIT_CPU, attrs->limit_cpu, "RLIMIT_CPU" },
+    };
+    for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+        if (!(attrs->set & limits[i].set)) {
+            continue;
+        }
+        struct rlimit rl = { .rlim_cur = limits[i].value, .rlim_max = limits[i].value };
+        if (setrlimit(limits[i].resource, &rl) < 0) {
+            fprintf(stderr, "Error: setrlimit(%s): %s\n", limits[i].name, strerror(errno));
+        }
+    }
+}
+
+//Parse a CPU list such as "0-3,8,10-11" into set. Returns 0 on success
+int parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= MAX_CPUS) {
+            return -1;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= MAX_CPUS) {
+                return -1;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && *p != '\n') {
+            return -1;
+        }
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+//Read a small integer from a sysfs file. Returns -1 if it is missing
+static int read_sysfs_int(const char *path) {
+    FILE *f = fopen(path, "r");
+    int value = -1;
+    if (f != NULL) {
+        if (fscanf(f, "%d", &value) != 1) {
+            value = -1;
+        }
+        fclose(f);
+    }
+    return value;
+}
+
+//Find the lowest CPU sharing the given cache level with cpu, or -1
+static int cache_domain(int cpu, int level) {
+    char path[256];
+    for (int index = 0; ; index++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+        int found = read_sysfs_int(path);
+        if (found < 0) {
+            return -1;
+        }
+        if (found != level) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+        FILE *f = fopen(path, "r");
+        char list[512];
+        cpu_set_t set;
+        int lowest = -1;
+        if (f != NULL) {
+            if (fgets(list, sizeof(list), f) != NULL && parse_cpu_list(list, &set) == 0) {
+                for (int c = 0; c < MAX_CPUS; c++) {
+                    if (CPU_ISSET(c, &set)) {
+                        lowest = c;
+                        break;
+                    }
+                }
+            }
+            fclose(f);
+        }
+        return lowest;
+    }
+}
+
+//Order CPUs so that cores sharing caches are next to each other
+static int compare_cpu_info(const void *a, const void *b) {
+    const CpuInfo *x = a, *y = b;
+    if (x->package != y->package) return x->package - y->package;
+    if (x->l3 != y->l3) return x->l3 - y->l3;
+    if (x->l2 != y->l2) return x->l2 - y->l2;
+    return x->cpu - y->cpu;
+}
+
+//Read the topology of the CPUs the shell may run on, once
+void load_cpu_topology() {
+    if (num_topology_cpus >= 0) {
+        return;
+    }
+    num_topology_cpus = 0;
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity");
+        return;
+    }
+
+    char path[256];
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        CpuInfo *info = &cpu_topology[num_topology_cpus++];
+        info->cpu = cpu;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        info->package = read_sysfs_int(path);
+        if (info->package < 0) {
+            info->package = 0;
+        }
+        info->l2 = cache_domain(cpu, 2);
+        info->l3 = cache_domain(cpu, 3);
+        //Without cache information fall back to the enclosing domain
+        if (info->l3 < 0) info->l3 = info->package;
+        if (info->l2 < 0) info->l2 = cpu;
+    }
+    qsort(cpu_topology, num_topology_cpus, sizeof(CpuInfo), compare_cpu_info);
+}
+
+//Choose the CPUs each stage of a pipeline is pinned to
+void place_pipeline(CmdSet *cmdset) {
+    int background = 0;
+    for (int i = 0; i < cmdset->num_commands; i++) {
+        cmdset->commands[i].has_affinity = 0;
+        background |= cmdset->commands[i].background;
+    }
+
+    if (affinity_mode == AFFINITY_AUTO) {
+        load_cpu_topology();
+    }
+
+    //Auto mode pins a job to every CPU of one shared L3 cache, so its stages pass data through
+    //that cache: the domain the shell runs on for foreground pipelines, the next domain in turn
+    //for background jobs. A lone foreground command is left free to use every core
+    cpu_set_t domain;
+    CPU_ZERO(&domain);
+    int auto_pin = affinity_mode == AFFINITY_AUTO && num_topology_cpus > 0 && (cmdset->num_commands > 1 || background);
+    if (auto_pin) {
+        //cpu_topology is sorted, so each domain is a run of entries; rank counts the domains
+        //before it on the same socket
+        int first[MAX_CPUS], package[MAX_CPUS], rank[MAX_CPUS];
+        int num_domains = 0, chosen = 0;
+        int current = background ? -1 : sched_getcpu();
+        for (int i = 0; i < num_topology_cpus; i++) {
+            if (i == 0 || cpu_topology[i].package != cpu_topology[i - 1].package || cpu_topology[i].l3 != cpu_topology[i - 1].l3) {
+                first[num_domains] = i;
+                package[num_domains] = cpu_topology[i].package;
+                rank[num_domains] = num_domains > 0 && package[num_domains - 1] == package[num_domains] ? rank[num_domains - 1] + 1 : 0;
+                num_domains++;
+            }
+            if (cpu_topology[i].cpu == current) {
+                chosen = num_domains - 1;
+            }
+        }
+        if (background) {
+            //Take the first domain of every socket, then the second, and so on
+            int turn = background_placements++ % num_domains, seen = 0;
+            for (int r = 0; seen <= turn; r++) {
+                for (int d = 0; d < num_domains && seen <= turn; d++) {
+                    if (rank[d] == r && seen++ == turn) {
+                        chosen = d;
+                    }
+                }
+            }
+        }
+        int end = chosen + 1 < num_domains ? first[chosen + 1] : num_topology_cpus;
+        for (int i = first[chosen]; i < end; i++) {
+            CPU_SET(cpu_topology[i].cpu, &domain);
+        }
+    }
+
+    for (int i = 0; i < cmdset->num_commands; i++) {
+        Cmd *cmd = &cmdset->commands[i];
+        if (cmd->cpus != NULL) {
+            cmd->has_affinity = parse_cpu_list(cmd->cpus, &cmd->affinity) == 0;
+        } else if (affinity_mode == AFFINITY_FIXED) {
+            cmd->affinity = affinity_fixed;
+            cmd->has_affinity = 1;
+        } else if (auto_pin) {
+            cmd->affinity = domain;
+            cmd->has_affinity = 1;
+        }
+    }
+}
+
+//affinity [off | auto | CPULIST]: set how pipeline stages are pinned to CPUs
+int builtin_affinity(char **args) {
+    if (args[1] == NULL) {
+        const char *modes[] = { "off", "auto", "fixed" };
+        printf("affinity: %s\n", modes[affinity_mode]);
+        load_cpu_topology();
+        for (int i = 0; i < num_topology_cpus; i++) {
+            printf("cpu %d: package %d, l2 %d, l3 %d\n", cpu_topology[i].cpu,
+                   cpu_topology[i].package, cpu_topology[i].l2, cpu_topology[i].l3);
+        }
+        return 0;
+    }
+
+    if (strcmp(args[1], "off") == 0) {
+        affinity_mode = AFFINITY_OFF;
+    } else if (strcmp(args[1], "auto") == 0) {
+        affinity_mode = AFFINITY_AUTO;
+    } else if (parse_cpu_list(args[1], &affinity_fixed) == 0) {
+        affinity_mode = AFFINITY_FIXED;
+    } else {
+        fprintf(stderr, "Error: Usage: affinity [off | auto | CPULIST]\n");
+        return 1;
+    }
+    return 0;
+}
+
+//Print scheduling attributes in the '@name=value' form they are given in
+void print_sched_attrs(const SchedAttrs *attrs) {
+    const char *policies[] = { [SCHED_OTHER] = "other", [SCHED_BATCH] = "batch", [SCHED_IDLE] = "idle" };
+    const char *classes[] = { "none", "rt", "be", "idle" };
+    if (attrs->set & SCHED_SET_NICE) printf(" @nice=%d", attrs->nice);
+    if (attrs->set & SCHED_SET_POLICY) printf(" @sched=%s", policies[attrs->policy]);
+    if (attrs->set & SCHED_SET_IOPRIO) printf(" @ioprio=%s:%d", classes[attrs->ioprio >> 13], attrs->ioprio & 7);
+    if (attrs->set & SCHED_SET_LIMIT_AS) printf(" @limit-as=%llu", (unsigned long long)attrs->limit_as);
+    if (attrs->set & SCHED_SET_LIMIT_NOFILE) printf(" @limit-nofile=%llu", (unsigned long long)attrs->limit_nofile);
+    if (attrs->set & SCHED_SET_LIMIT_CPU) printf(" @limit-cpu=%llu", (unsigned long long)attrs->limit_cpu);
+    printf("\n");
+}
+
+//sched [off | @attr=value ...]: set default scheduling attributes for background jobs
+int builtin_sched(char **args) {
+    if (args[1] == NULL) {
+        printf("sched:");
+        print_sched_attrs(&background_sched);
+        return 0;
+    }
+    if (strcmp(args[1], "off") == 0) {
+        background_sched = (SchedAttrs) { .set = 0 };
+        return 0;
+    }
+
+    Cmd defaults = { .sched = background_sched };
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] != '@' || parse_attribute(&defaults, args[i]) < 0) {
+            fprintf(stderr, "Error: Usage: sched [off | @attr=value ...]\n");
+            return 1;
+        }
+    }
+    background_sched = defaults.sched;
+    return 0;
+}
+
+//Create a child with fork. With a cgroup fd the child moves itself into that cgroup, and
+//exits rather than run outside its limits. Job children use stdio and malloc before exec,
+//which needs fork's lock handling, so they are not created with clone3(CLONE_INTO_CGROUP)
+pid_t spawn_process(int cgroup_fd) {
+    pid_t pid = fork();
+    if (pid == 0 && cgroup_fd >= 0 && write_cgroup_file(cgroup_fd, "cgroup.procs", "0") < 0) {
+        fprintf(stderr, "Error: cgroup.procs: %s\n", strerror(errno));
+        _exit(126);
+    }
+    return pid;
+}
+
+//Write a value to a file of the cgroup open as dir_fd. Returns 0 on success
+int write_cgroup_file(int dir_fd, const char *name, const char *value) {
+    int fd = openat(dir_fd, name, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = write(fd, value, strlen(value));
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return n < 0 ? -1 : 0;
+}
+
+//Prepare the delegated subtree: move the shell into a leaf and enable controllers
+int setup_cgroups() {
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL) {
+        perror("Error: /proc/self/cgroup");
+        return -1;
+    }
+    char line[PATH_MAX], *path = NULL;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            path = line + 3;
+            break;
+        }
+    }
+    fclose(f);
+    if (path == NULL) {
+        fprintf(stderr, "Error: The shell is not in a cgroup v2 hierarchy.\n");
+        return -1;
+    }
+
+    //A shell already moved into its leaf keeps using the parent
+    size_t len = strlen(path);
+    if (len >= 11 && strcmp(path + len - 11, "/mysh-shell") == 0) {
+        path[len - 11] = '\0';
+    }
+
+    //The v2 hierarchy is /sys/fs/cgroup, or /sys/fs/cgroup/unified on hybrid hosts
+    const char *mount_point = "/sys/fs/cgroup";
+    FILE *mounts = setmntent("/proc/self/mounts", "r");
+    struct mntent *entry;
+    while (mounts != NULL && (entry = getmntent(mounts)) != NULL) {
+        if (strcmp(entry->mnt_type, "cgroup2") == 0) {
+            mount_point = strdup(entry->mnt_dir);
+            break;
+        }
+    }
+    if (mounts != NULL) {
+        endmntent(mounts);
+    }
+    if (snprintf(cgroup_base, sizeof(cgroup_base), "%s%s", mount_point, strcmp(path, "/") == 0 ? "" : path) >= (int)sizeof(cgroup_base)) {
+        fprintf(stderr, "Error: cgroup path is too long.\n");
+        return -1;
+    }
+
+    int base_fd = open(cgroup_base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd < 0 || faccessat(base_fd, "cgroup.subtree_control", W_OK, 0) < 0) {
+        fprintf(stderr, "Error: cgroup %s is not delegated to this user.\n", cgroup_base);
+        if (base_fd >= 0) close(base_fd);
+        return -1;
+    }
+
+    //Processes may only live in leaves once controllers are enabled
+    char pid_text[32];
+    snprintf(pid_text, sizeof(pid_text), "%d", getpid());
+    if ((mkdirat(base_fd, "mysh-shell", 0755) < 0 && errno != EEXIST)) {
+        fprintf(stderr, "Error: mkdir %s/mysh-shell: %s\n", cgroup_base, strerror(errno));
+        close(base_fd);
+        return -1;
+    }
+    int leaf_fd = openat(base_fd, "mysh-shell", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (leaf_fd < 0 || write_cgroup_file(leaf_fd, "cgroup.procs", pid_text) < 0) {
+        fprintf(stderr, "Error: Cannot move the shell into %s/mysh-shell: %s\n", cgroup_base, strerror(errno));
+        if (leaf_fd >= 0) close(leaf_fd);
+        close(base_fd);
+        return -1;
+    }
+    close(leaf_fd);
+
+    const char *controllers[] = { "+memory", "+cpu", "+io" };
+    for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+        if (write_cgroup_file(base_fd, "cgroup.subtree_control", controllers[i]) < 0) {
+            fprintf(stderr, "Warning: Cannot enable %s controller: %s\n", controllers[i] + 1, strerror(errno));
+        }
+    }
+    close(base_fd);
+    return 0;
+}
+
+//Create the cgroup of a job and apply its limits. Returns 0 on success
+int create_job_cgroup(Job *job, CmdSet *cmdset) {
+    //The first stage giving a limit sets it for the whole job
+    CgroupLimits limits = cgroup_defaults;
+    for (int i = cmdset->num_commands - 1; i >= 0; i--) {
+        CgroupLimits *own = &cmdset->commands[i].limits;
+        if (own->memory_max != NULL) limits.memory_max = own->memory_max;
+        if (own->cpu_max != NULL) limits.cpu_max = own->cpu_max;
+        if (own->io_max != NULL) limits.io_max = own->io_max;
+    }
+
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/mysh-job%d", cgroup_base, job->id);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: mkdir %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    job->cgroup_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (job->cgroup_fd < 0) {
+        fprintf(stderr, "Error: open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct { const char *file; const char *value; } settings[] = {
+        { "memory.max", limits.memory_max },
+        { "cpu.max", limits.cpu_max },
+        { "io.max", limits.io_max },
+    };
+    for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); i++) {
+        if (settings[i].value != NULL && write_cgroup_file(job->cgroup_fd, settings[i].file, settings[i].value) < 0) {
+            fprintf(stderr, "Error: %s/%s: %s\n", path, settings[i].file, strerror(errno));
+        }
+    }
+    return 0;
+}
+
+//Read the accounting of finished jobs from their cgroups and remove the groups
+void collect_finished_jobs() {
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old_mask);
+
+    for (int i = 0; i < MAX_JOBS; i++) {
+        Job *job = &jobs[i];
+        if (job->id == 0 || job->num_running > 0 || job->collected) {
+            continue;
+        }
+        job->collected = 1;
+        if (job->perf == PERF_REPORT) {
+            print_perf_report(job);
+        }
+        if (job->cgroup_fd < 0) {
+            continue;
+        }
+
+        char buf[1024];
+        int fd = openat(job->cgroup_fd, "memory.peak", O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            ssize_t n = read(fd, buf, sizeof(buf) - 1);
+            if (n > 0) {
+                buf[n] = '\0';
+                job->memory_peak = strtoll(buf, NULL, 10);
+            }
+            close(fd);
+        }
+        fd = openat(job->cgroup_fd, "cpu.stat", O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            ssize_t n = read(fd, buf, sizeof(buf) - 1);
+            if (n > 0) {
+                buf[n] = '\0';
+                char *field = strstr(buf, "usage_usec ");
+                if (field != NULL) {
+                    job->cpu_usec = strtoll(field + strlen("usage_usec "), NULL, 10);
+                }
+            }
+            close(fd);
+        }
+        close(job->cgroup_fd);
+        job->cgroup_fd = -1;
+
+        char path[PATH_MAX + 32];
+        snprintf(path, sizeof(path), "%s/mysh-job%d", cgroup_base, job->id);
+        if (rmdir(path) < 0 && errno != ENOENT) {
+            fprintf(stderr, "Error: rmdir %s: %s\n", path, strerror(errno));
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+//cgroup [on | off] [@memory.max=SIZE @cpu.max=QUOTA:PERIOD @io.max=MAJ:MIN,rbps=N]: run each job in its own cgroup
+int builtin_cgroup(char **args) {
+    if (args[1] == NULL) {
+        printf("cgroup: %s %s\n", cgroup_enabled ? "on" : "off", cgroup_enabled ? cgroup_base : "");
+        for (int i = 0; i < MAX_JOBS; i++) {
+            Job *job = &jobs[i];
+            if (job->id != 0) {
+                print_job_accounting(job);
+            }
+        }
+        return 0;
+    }
+
+    Cmd defaults = { .limits = cgroup_defaults };
+    int enable = cgroup_enabled;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "on") == 0) {
+            enable = 1;
+        } else if (strcmp(args[i], "off") == 0) {
+            enable = 0;
+            defaults.limits = (CgroupLimits) { NULL, NULL, NULL };
+        } else if (args[i][0] != '@' || parse_attribute(&defaults, args[i]) < 0) {
+            fprintf(stderr, "Error: Usage: cgroup [on | off] [@memory.max=SIZE @cpu.max=QUOTA:PERIOD @io.max=MAJ:MIN,rbps=N]\n");
+            return 1;
+        }
+    }
+    if (enable && !cgroup_enabled && setup_cgroups() < 0) {
+        return 1;
+    }
+    cgroup_enabled = enable;
+    cgroup_defaults = defaults.limits;
+    return 0;
+}
+
+//Run as a container entrypoint: supervise one job, forward signals to it and reap every orphan.
+//Without a command the supervised job is an interactive shell. Returns the job's exit code
+int run_init(char **command) {
+    //Signals are taken synchronously with sigwaitinfo, so one wakeup can reap a burst of exits
+    int forwarded[] = { SIGTERM, SIGINT, SIGHUP, SIGQUIT, SIGUSR1, SIGUSR2, SIGWINCH, SIGCONT };
+    sigset_t set, old_mask;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    for (size_t i = 0; i < sizeof(forwarded) / sizeof(forwarded[0]); i++) {
+        sigaddset(&set, forwarded[i]);
+    }
+    sigprocmask(SIG_BLOCK, &set, &old_mask);
+
+    if (getpid() != 1 && prctl(PR_SET_CHILD_SUBREAPER, 1) < 0) {
+        perror("prctl(PR_SET_CHILD_SUBREAPER)");
+    }
+
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork failed");
+        return 1;
+    }
+    if (child == 0) {
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        //The job gets its own process group so signals reach its whole pipeline
+        setpgid(0, 0);
+        if (isatty(STDIN_FILENO)) {
+            signal(SIGTTOU, SIG_IGN);
+            tcsetpgrp(STDIN_FILENO, getpid());
+            signal(SIGTTOU, SIG_DFL);
+        }
+        if (command[0] == NULL) {
+            //Fall through to the interactive shell loop
+            return -1;
+        }
+        execvpe(command[0], command, current_envp());
+        fprintf(stderr, "Error: %s: %s\n", command[0], strerror(errno));
+        _exit(errno == ENOENT ? 127 : 126);
+    }
+    setpgid(child, child);
+
+    int exit_code = 0;
+    while (1) {
+        siginfo_t info;
+        int signo = sigwaitinfo(&set, &info);
+        if (signo < 0) {
+            continue;
+        }
+
+        if (signo != SIGCHLD) {
+            //Forward to the job's process group, or the job alone if it left it
+            if (kill(-child, signo) < 0) {
+                kill(child, signo);
+            }
+            continue;
+        }
+
+        //Reap every child that has exited, including reparented orphans
+        while (1) {
+            siginfo_t exited = { .si_pid = 0 };
+            if (waitid(P_ALL, 0, &exited, WEXITED | WNOHANG) < 0 || exited.si_pid == 0) {
+                break;
+            }
+            if (exited.si_pid == child) {
+                exit_code = exited.si_code == CLD_EXITED ? exited.si_status : 128 + exited.si_status;
+                child = 0;
+            }
+        }
+        if (child == 0) {
+            return exit_code;
+        }
+    }
+}
+
+//Sample of one pipeline stage for 'jobs --top'
+typedef struct {
+    pid_t pid;
+    unsigned long long ticks;   // utime + stime from /proc/<pid>/stat
+} StageSample;
+
+StageSample stage_samples[MAX_JOBS][MAX_CMDS];
+struct timespec last_top_sample;
+
+//Read the state and CPU ticks of a process. Returns -1 once it has exited
+static int read_proc_stat(pid_t pid, char *state, unsigned long long *ticks) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+
+    //The command name may contain spaces, so fields are counted from its closing ')'
+    char *p = strrchr(buf, ')');
+    unsigned long long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                            state, &utime, &stime) != 3) {
+        return -1;
+    }
+    *ticks = utime + stime;
+    return 0;
+}
+
+//Resident set size of a process in KiB from /proc/<pid>/statm
+static long read_proc_rss(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+    FILE *f = fopen(path, "re");
+    long size, resident = 0;
+    if (f != NULL) {
+        if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+//Bytes queued in the pipe on fd of a process, and the pipe's capacity. Returns -1 if fd is not a pipe.
+//The shell closes its ends after spawning, so the pipe is reopened through /proc for the sample
+static int read_pipe_fill(pid_t pid, int fd_number, int *queued, int *capacity) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", pid, fd_number);
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = ioctl(fd, FIONREAD, queued);
+    *capacity = fcntl(fd, F_GETPIPE_SZ);
+    close(fd);
+    return result < 0 || *capacity <= 0 ? -1 : 0;
+}
+
+//Print one frame of the job monitor. The first sample only records CPU ticks
+void show_job_top(int first_sample) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - last_top_sample.tv_sec) + (now.tv_nsec - last_top_sample.tv_nsec) / 1e9;
+    last_top_sample = now;
+    long ticks_per_second = sysconf(_SC_CLK_TCK);
+
+    if (!first_sample) {
+        printf("%-6s %-8s %-5s %6s %10s %18s %18s\n", "JOB", "PID", "STATE", "CPU%", "RSS", "IN PIPE", "OUT PIPE");
+    }
+    for (int j = 0; j < MAX_JOBS; j++) {
+        Job *job = &jobs[j];
+        if (job->id == 0 || job->num_running == 0) {
+            continue;
+        }
+
+        int in_queued[MAX_CMDS], in_capacity[MAX_CMDS], out_queued[MAX_CMDS], out_capacity[MAX_CMDS];
+        char states[MAX_CMDS];
+        double cpu[MAX_CMDS];
+        long rss[MAX_CMDS];
+        for (int i = 0; i < job->num_pids; i++) {
+            StageSample *sample = &stage_samples[j][i];
+            unsigned long long ticks = 0;
+            if (read_proc_stat(job->pids[i], &states[i], &ticks) < 0) {
+                states[i] = '-';
+            }
+            cpu[i] = 0;
+            if (!first_sample && sample->pid == job->pids[i] && elapsed > 0 && ticks >= sample->ticks) {
+                cpu[i] = 100.0 * (ticks - sample->ticks) / ticks_per_second / elapsed;
+            }
+            *sample = (StageSample) { .pid = job->pids[i], .ticks = ticks };
+            if (first_sample) {
+                continue;
+            }
+            rss[i] = states[i] == '-' ? 0 : read_proc_rss(job->pids[i]);
+
+            if (states[i] == '-' || read_pipe_fill(job->pids[i], STDIN_FILENO, &in_queued[i], &in_capacity[i]) < 0) {
+                in_queued[i] = in_capacity[i] = -1;
+            }
+            if (states[i] == '-' || read_pipe_fill(job->pids[i], STDOUT_FILENO, &out_queued[i], &out_capacity[i]) < 0) {
+                out_queued[i] = out_capacity[i] = -1;
+            }
+        }
+        if (first_sample) {
+            continue;
+        }
+        printf("[%d] %s\n", job->id, job->cmdline);
+
+        //The bottleneck has a full input pipe and an empty (or no) output pipe
+        int bottleneck = -1;
+        for (int i = 0; i < job->num_pids; i++) {
+            int input_full = in_capacity[i] > 0 && in_queued[i] >= in_capacity[i] * 9 / 10;
+            int output_empty = out_capacity[i] <= 0 || out_queued[i] == 0;
+            if (states[i] != '-' && input_full && output_empty) {
+                bottleneck = i;
+                break;
+            }
+        }
+
+        for (int i = 0; i < job->num_pids; i++) {
+            char in_pipe[32] = "-", out_pipe[32] = "-";
+            if (in_capacity[i] > 0) {
+                snprintf(in_pipe, sizeof(in_pipe), "%d/%dK", in_queued[i], in_capacity[i] / 1024);
+            }
+            if (out_capacity[i] > 0) {
+                snprintf(out_pipe, sizeof(out_pipe), "%d/%dK", out_queued[i], out_capacity[i] / 1024);
+            }
+            printf("  %-4d %-8d %-5c %6.1f %9ldK %18s %18s%s\n", i, job->pids[i], states[i], cpu[i], rss[i],
+                   in_pipe, out_pipe, i == bottleneck ? "  <- bottleneck" : "");
+
+            MeterStats *meter = meter_stats != NULL ? &meter_stats[j][i] : NULL;
+            if (meter != NULL && meter->pid == job->pids[i]) {
+                printf("       meter: %llu bytes, %llu lines, %.1f MiB/s\n", __atomic_load_n(&meter->bytes, __ATOMIC_RELAXED),
+                       __atomic_load_n(&meter->lines, __ATOMIC_RELAXED),
+                       __atomic_load_n(&meter->rate, __ATOMIC_RELAXED) / 1048576.0);
+            }
+        }
+    }
+    fflush(stdout);
+}
+
+//jobs [-l | --top [-d SECONDS] [-n COUNT]]: list jobs, their accounting, or monitor running pipelines stage by stage
+int builtin_jobs(char **args) {
+    if (args[1] == NULL) {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            Job *job = &jobs[i];
+            if (job->id != 0 && job->background) {
+                printf("[%d] %-8s %s\n", job->id, job->num_running > 0 ? "Running" : "Done", job->cmdline);
+            }
+        }
+        return 0;
+    }
+    if (strcmp(args[1], "-l") == 0) {
+        //Every job still in the table, with its resource accounting
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (jobs[i].id != 0) {
+                print_job_accounting(&jobs[i]);
+            }
+        }
+        return 0;
+    }
+    if (strcmp(args[1], "--top") != 0) {
+        fprintf(stderr, "Error: Usage: jobs [-l | --top [-d SECONDS] [-n COUNT]]\n");
+        return 1;
+    }
+
+    //A terminal refreshes until a key is pressed, otherwise one frame is printed
+    int interactive = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+    double delay = 1;
+    long count = interactive ? -1 : 1;
+    for (int i = 2; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-d") == 0 && args[i + 1] != NULL) {
+            delay = strtod(args[++i], NULL);
+        } else if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL) {
+            count = strtol(args[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "Error: Usage: jobs [-l | --top [-d SECONDS] [-n COUNT]]\n");
+            return 1;
+        }
+    }
+    if (delay <= 0) {
+        delay = 1;
+    }
+
+    //CPU usage needs two samples, so take a short baseline first
+    show_job_top(1);
+    usleep(100000);
+    struct pollfd input = { .fd = STDIN_FILENO, .events = POLLIN };
+    for (long frame = 0; count < 0 || frame < count; frame++) {
+        if (interactive) {
+            printf("\033[H\033[2J");
+        }
+        collect_finished_jobs();
+        show_job_top(0);
+        if (count >= 0 && frame + 1 >= count) {
+            break;
+        }
+        if (interactive && poll(&input, 1, (int)(delay * 1000)) != 0) {
+            //Consume the key that stopped the monitor
+            char line[MAX_CMD_LENGTH];
+            if (fgets(line, sizeof(line), stdin) == NULL) {
+                clearerr(stdin);
+            }
+            break;
+        } else if (!interactive) {
+            usleep((useconds_t)(delay * 1000000));
+        }
+    }
+    return 0;
+}
+
+//Print a meter report to stderr
+static void print_meter(MeterStats *stats, double elapsed, int count_lines, const char *end) {
+    double mib = stats->bytes / 1048576.0;
+    fprintf(stderr, "\rmeter: %.1f MiB in %.1fs [%.1f MiB/s]", mib, elapsed, stats->rate / 1048576.0);
+    if (count_lines) {
+        fprintf(stderr, " [%llu lines, %.0f lines/s]", stats->lines, elapsed > 0 ? stats->lines / elapsed : 0);
+    }
+    fprintf(stderr, "%s", end);
+}
+
+//meter [-l] [-q] [-i SECONDS]: relay stdin to stdout with splice and report throughput.
+//Counting lines (-l) needs the data in user space, so it copies through a buffer instead
+int builtin_meter(char **args) {
+    int count_lines = 0, quiet = 0;
+    double interval = 1;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-l") == 0) {
+            count_lines = 1;
+        } else if (strcmp(args[i], "-q") == 0) {
+            quiet = 1;
+        } else if (strcmp(args[i], "-i") == 0 && args[i + 1] != NULL) {
+            interval = strtod(args[++i], NULL);
+        } else {
+            fprintf(stderr, "Error: Usage: meter [-l] [-q] [-i SECONDS]\n");
+            return 1;
+        }
+    }
+
+    //Builtin stages run in the forked child, where current_job still names the job being spawned
+    MeterStats local = { 0 }, *stats = &local;
+    if (meter_stats != NULL && current_job != NULL && current_job->num_pids < MAX_CMDS) {
+        stats = &meter_stats[current_job - jobs][current_job->num_pids];
+        *stats = (MeterStats) { .pid = getpid() };
+    }
+
+    struct timespec start, last, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    last = start;
+    unsigned long long last_bytes = 0;
+    size_t chunk = 1 << 20;
+    char *buf = NULL;
+    int use_splice = !count_lines;
+    int status = 0;
+
+    while (1) {
+        ssize_t n;
+        if (use_splice) {
+            n = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINVAL && stats->bytes == 0) {
+                //Neither side is a pipe
+                use_splice = 0;
+                continue;
+            }
+        } else {
+            if (buf == NULL && (buf = malloc(chunk)) == NULL) {
+                perror("meter");
+                return 1;
+            }
+            n = read(STDIN_FILENO, buf, chunk);
+            for (ssize_t off = 0; n > 0 && off < n; ) {
+                ssize_t written = write(STDOUT_FILENO, buf + off, n - off);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    n = -1;
+                    break;
+                }
+                off += written;
+            }
+            if (n > 0 && count_lines) {
+                for (char *p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++) {
+                    stats->lines++;
+                }
+            }
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EPIPE) {
+                perror("meter");
+            }
+            status = 1;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        __atomic_store_n(&stats->bytes, stats->bytes + n, __ATOMIC_RELAXED);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double since = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+        if (since >= interval) {
+            __atomic_store_n(&stats->rate, (unsigned long long)((stats->bytes - last_bytes) / since), __ATOMIC_RELAXED);
+            last = now;
+            last_bytes = stats->bytes;
+            if (!quiet) {
+                print_meter(stats, (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9, count_lines, "");
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    stats->rate = elapsed > 0 ? stats->bytes / elapsed : 0;
+    if (!quiet) {
+        print_meter(stats, elapsed, count_lines, "\n");
+    }
+    free(buf);
+    return status;
+}
+
+//Nanoseconds between two CLOCK_MONOTONIC readings
+static uint64_t elapsed_ns(const struct timespec *from, const struct timespec *to) {
+    return (uint64_t)(to->tv_sec - from->tv_sec) * 1000000000ull + to->tv_nsec - from->tv_nsec;
+}
+
+//Parse, run and wait for one command line. Returns its exit status
+int run_command_line(char *cmd) {
+    SessionRecord timing = { 0 };
+    struct timespec now, parsed, spawned, waited;
+    clock_gettime(CLOCK_REALTIME, &now);
+    timing.time_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    //A line is recorded with the directory it started in, which 'cd' may change
+    char cwd[PATH_MAX] = "";
+    if (record_fd >= 0 && getcwd(cwd, sizeof(cwd)) == NULL) {
+        cwd[0] = '\0';
+    }
+
+    //Parse and execute commands
+    CmdSet cmdset = parse_command(cmd);
+    clock_gettime(CLOCK_MONOTONIC, &parsed);
+
+    foreground_job = NULL;
+    if (cmdset.num_commands > 0) {
+        //Execute parsed commands
+        execute_commands(&cmdset);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &spawned);
+
+    //Wait for foreground processes to finish 
+    handle_foreground_pids();  
+    if (foreground_job != NULL) {
+        int status = foreground_job->status;
+        last_status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+        foreground_job = NULL;
+    }
+    collect_finished_jobs();
+    clock_gettime(CLOCK_MONOTONIC, &waited);
+    if (cmdset.num_commands > 0) {
+        last_duration_ns = elapsed_ns(&now, &waited);
+    }
+
+    if (record_fd >= 0 && cmdset.num_commands > 0) {
+        timing.parse_ns = elapsed_ns(&now, &parsed);
+        timing.spawn_ns = elapsed_ns(&parsed, &spawned);
+        timing.wait_ns = elapsed_ns(&spawned, &waited);
+        timing.status = last_status;
+        record_line(cmd, cwd, &timing);
+    }
+    return last_status;
+}
+
+//Open a session log for appending, writing the magic to a new file. Returns 0 on success
+int start_recording(const char *path) {
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        fprintf(stderr, "Error: open(\"%s\"): %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0 && write(fd, SESSION_MAGIC, 8) != 8) {
+        fprintf(stderr, "Error: write(\"%s\"): %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (record_fd >= 0) {
+        close(record_fd);
+    }
+    record_fd = fd;
+    //The first record of every session carries the working directory
+    recorded_cwd[0] = '\0';
+    return 0;
+}
+
+//Append one command line, run in cwd, to the session log with a single write
+void record_line(const char *cmd, const char *cwd, const SessionRecord *timing) {
+    SessionRecord record = *timing;
+    size_t line_len = strcspn(cmd, "\n");
+    record.line_len = line_len;
+
+    record.cwd_len = 0;
+    if (cwd[0] != '\0' && strcmp(cwd, recorded_cwd) != 0) {
+        record.cwd_len = strlen(cwd);
+        strcpy(recorded_cwd, cwd);
+    }
+
+    struct iovec parts[] = {
+        { &record, sizeof(record) },
+        { (void *)cmd, line_len },
+        { (void *)cwd, record.cwd_len },
+    };
+    if (writev(record_fd, parts, 3) < 0) {
+        fprintf(stderr, "Error: Session log: %s\n", strerror(errno));
+    }
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+//Re-run a recorded session and report the shell's latency per line. Returns 0 on success
+int run_replay(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error: open(\"%s\"): %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (st.st_size < 8) {
+        fprintf(stderr, "Error: %s is not a session log.\n", path);
+        close(fd);
+        return 1;
+    }
+    char *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (log == MAP_FAILED || memcmp(log, SESSION_MAGIC, 8) != 0) {
+        fprintf(stderr, "Error: %s is not a session log.\n", path);
+        return 1;
+    }
+
+    size_t capacity = 1024, count = 0;
+    uint64_t *replayed = malloc(capacity * sizeof(uint64_t));
+    uint64_t recorded_total = 0, replayed_total = 0;
+    int mismatches = 0;
+    char line[MAX_CMD_LENGTH], cwd[PATH_MAX];
+
+    for (off_t off = 8; off + (off_t)sizeof(SessionRecord) <= st.st_size; ) {
+        SessionRecord record;
+        memcpy(&record, log + off, sizeof(record));
+        off += sizeof(record);
+        if (off + record.line_len + record.cwd_len > st.st_size || record.line_len >= sizeof(line) ||
+            record.cwd_len >= sizeof(cwd)) {
+            fprintf(stderr, "Error: %s is truncated.\n", path);
+            break;
+        }
+        memcpy(line, log + off, record.line_len);
+        line[record.line_len] = '\0';
+        off += record.line_len;
+        if (record.cwd_len > 0) {
+            memcpy(cwd, log + off, record.cwd_len);
+            cwd[record.cwd_len] = '\0';
+            if (chdir(cwd) < 0) {
+                fprintf(stderr, "Warning: chdir(\"%s\"): %s\n", cwd, strerror(errno));
+            }
+            off += record.cwd_len;
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int status = run_command_line(line);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (count == capacity) {
+            capacity *= 2;
+            replayed = realloc(replayed, capacity * sizeof(uint64_t));
+        }
+        replayed[count++] = elapsed_ns(&start, &end);
+        replayed_total += elapsed_ns(&start, &end);
+        recorded_total += record.parse_ns + record.spawn_ns + record.wait_ns;
+        if (!replay_stub && status != record.status) {
+            mismatches++;
+        }
+    }
+    munmap(log, st.st_size);
+
+    if (count > 0) {
+        qsort(replayed, count, sizeof(uint64_t), compare_u64);
+        fprintf(stderr, "replay: %zu lines%s, recorded %.3f ms, replayed %.3f ms\n", count,
+                replay_stub ? " (stubbed)" : "", recorded_total / 1e6, replayed_total / 1e6);
+        fprintf(stderr, "per line: mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                replayed_total / 1e3 / count, replayed[count / 2] / 1e3, replayed[count * 99 / 100] / 1e3,
+                replayed[count - 1] / 1e3);
+        if (mismatches > 0) {
+            fprintf(stderr, "%d lines exited with a different status than recorded\n", mismatches);
+        }
+    }
+    free(replayed);
+    return 0;
+}
+
+//record [FILE | off]: append every command line to a session log
+int builtin_record(char **args) {
+    if (args[1] == NULL) {
+        printf("record: %s\n", record_fd >= 0 ? "on" : "off");
+        return 0;
+    }
+    if (strcmp(args[1], "off") == 0) {
+        if (record_fd >= 0) {
+            close(record_fd);
+            record_fd = -1;
+        }
+        return 0;
+    }
+    return start_recording(args[1]) < 0 ? 1 : 0;
+}
+
+//Attach counters to a stage that is waiting before exec. inherit also counts its children
+void open_perf_counters(Job *job, int stage, pid_t pid) {
+    for (int c = 0; c < NUM_PERF_COUNTERS; c++) {
+        const PerfCounter *counter = &perf_counters[c];
+        struct perf_event_attr attr = {
+            .size = sizeof(attr),
+            .type = counter->type,
+            .config = counter->config,
+            .inherit = 1,
+            .exclude_hv = 1,
+            .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
+        };
+        int kind = PERF_KIND_PRIMARY;
+        int fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0 && errno == EACCES) {
+            //perf_event_paranoid >= 2 only allows user-space counting
+            attr.exclude_kernel = 1;
+            fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+        if (fd < 0 && counter->fallback_name != NULL) {
+            attr.type = counter->fallback_type;
+            attr.config = counter->fallback_config;
+            kind = PERF_KIND_FALLBACK;
+            fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+        job->perf_fds[stage][c] = fd;
+        job->perf_kinds[stage][c] = fd < 0 ? PERF_KIND_NONE : kind;
+    }
+}
+
+//Read and close the counters of a stage that has exited. Called from signal_handler
+void read_perf_counters(Job *job, int stage) {
+    for (int c = 0; c < NUM_PERF_COUNTERS; c++) {
+        int fd = job->perf_fds[stage][c];
+        if (fd < 0) {
+            continue;
+        }
+        //value, time enabled, time running; scaled up if the counter was multiplexed
+        uint64_t values[3];
+        if (read(fd, values, sizeof(values)) == sizeof(values)) {
+            uint64_t count = values[0];
+            if (values[2] > 0 && values[2] < values[1]) {
+                count = (uint64_t)((double)count * values[1] / values[2]);
+            }
+            job->perf_counts[stage][c] = count;
+        }
+        close(fd);
+        job->perf_fds[stage][c] = -1;
+    }
+}
+
+//Print the counters of each stage of a finished job to stderr, like 'perf stat'
+void print_perf_report(Job *job) {
+    fprintf(stderr, "\n Performance counter stats for '%s':\n\n", job->cmdline);
+    for (int c = 0; c < NUM_PERF_COUNTERS; c++) {
+        const PerfCounter *counter = &perf_counters[c];
+        unsigned long long total = 0;
+        int kind = PERF_KIND_NONE;
+        char stages[256] = "";
+        size_t len = 0;
+        for (int i = 0; i < job->num_pids; i++) {
+            if (job->perf_kinds[i][c] == PERF_KIND_NONE) {
+                continue;
+            }
+            kind = job->perf_kinds[i][c];
+            total += job->perf_counts[i][c];
+            if (job->num_pids > 1 && len < sizeof(stages)) {
+                len += snprintf(stages + len, sizeof(stages) - len, "%s%llu", len > 0 ? " / " : "  (", job->perf_counts[i][c]);
+            }
+        }
+        if (kind == PERF_KIND_NONE) {
+            fprintf(stderr, "%20s  %s\n", "<not supported>", counter->name);
+            continue;
+        }
+        fprintf(stderr, "%20llu  %s%s", total, kind == PERF_KIND_FALLBACK ? counter->fallback_name : counter->name, stages);
+        fprintf(stderr, "%s\n", len > 0 ? ")" : "");
+    }
+    double seconds = (job->finished.tv_sec - job->started.tv_sec) + (job->finished.tv_nsec - job->started.tv_nsec) / 1e9;
+    fprintf(stderr, "\n %19.6f seconds time elapsed\n\n", seconds);
+}
+
+//Print one line of resource accounting for a job
+void print_job_accounting(Job *job) {
+    printf("[%d] user %ld.%03lds sys %ld.%03lds maxrss %ldK", job->id,
+           (long)job->usage.ru_utime.tv_sec, (long)job->usage.ru_utime.tv_usec / 1000,
+           (long)job->usage.ru_stime.tv_sec, (long)job->usage.ru_stime.tv_usec / 1000, job->usage.ru_maxrss);
+    if (job->memory_peak > 0 || job->cpu_usec > 0) {
+        printf(" memory.peak %lldK cpu %lld.%03llds", job->memory_peak / 1024,
+               job->cpu_usec / 1000000, job->cpu_usec / 1000 % 1000);
+    }
+    if (job->perf != PERF_OFF) {
+        for (int c = 0; c < NUM_PERF_COUNTERS; c++) {
+            unsigned long long total = 0;
+            int kind = PERF_KIND_NONE;
+            for (int i = 0; i < job->num_pids; i++) {
+                if (job->perf_kinds[i][c] != PERF_KIND_NONE) {
+                    kind = job->perf_kinds[i][c];
+                    total += job->perf_counts[i][c];
+                }
+            }
+            if (kind != PERF_KIND_NONE) {
+                printf(" %s %llu", kind == PERF_KIND_FALLBACK ? perf_counters[c].fallback_name : perf_counters[c].name, total);
+            }
+        }
+    }
+    printf("  %s\n", job->cmdline);
+}
+
+//perf [on | off]: count hardware events for every job, shown by 'jobs -l'
+int builtin_perf(char **args) {
+    if (args[1] == NULL) {
+        printf("perf: %s\n", perf_accounting ? "on" : "off");
+    } else if (strcmp(args[1], "on") == 0) {
+        perf_accounting = 1;
+    } else if (strcmp(args[1], "off") == 0) {
+        perf_accounting = 0;
+    } else {
+        fprintf(stderr, "Error: Usage: perf [on | off]\n");
+        return 1;
+    }
+    return 0;
+}
+
+//Open the history file named by $MYSH_HISTFILE, or ~/.mysh_history
+void open_history() {
+    char path[PATH_MAX];
+    const char *file = getenv("MYSH_HISTFILE");
+    if (file == NULL) {
+        const char *home = getenv("HOME");
+        if (home == NULL) {
+            return;
+        }
+        snprintf(path, sizeof(path), "%s/.mysh_history", home);
+        file = path;
+    }
+    snprintf(history.path, sizeof(history.path), "%s", file);
+    history.fd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (history.fd < 0) {
+        fprintf(stderr, "Error: open(\"%s\"): %s\n", file, strerror(errno));
+    }
+}
+
+//Map lines appended since the last refresh
+void refresh_history() {
+    if (history.fd < 0) {
+        open_history();
+        if (history.fd < 0) {
+            return;
+        }
+    }
+    struct stat st, named;
+    if (fstat(history.fd, &st) < 0) {
+        return;
+    }
+
+    //A rotated file is replaced at the path, a truncated one shrinks: index it again from 0
+    int rotated = stat(history.path, &named) == 0 && (named.st_ino != st.st_ino || named.st_dev != st.st_dev);
+    if (rotated || (size_t)st.st_size < history.complete_len) {
+        if (history.map != NULL) {
+            munmap(history.map, history.map_len);
+        }
+        history.map = NULL;
+        history.map_len = 0;
+        history.complete_len = 0;
+        history.count = -1;
+        if (rotated) {
+            close(history.fd);
+            open_history();
+            if (history.fd < 0 || fstat(history.fd, &st) < 0) {
+                return;
+            }
+        }
+    }
+    if ((size_t)st.st_size == history.map_len) {
+        return;
+    }
+
+    size_t len = st.st_size;
+    char *map = history.map == NULL
+        ? mmap(NULL, len, PROT_READ, MAP_SHARED, history.fd, 0)
+        : mremap(history.map, history.map_len, len, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    history.map = map;
+    history.map_len = len;
+
+    //Only complete lines count, a concurrent append may still be in flight. Just the
+    //appended bytes are scanned, backwards from the end
+    const char *newline = memrchr(map + history.complete_len, '\n', len - history.complete_len);
+    if (newline == NULL) {
+        return;
+    }
+    size_t complete_len = newline + 1 - map;
+    if (history.count >= 0) {
+        for (const char *p = map + history.complete_len; p < newline + 1; p = (char *)memchr(p, '\n', newline + 1 - p) + 1) {
+            history.count++;
+        }
+    }
+    history.complete_len = complete_len;
+}
+
+//Length of the history entry starting at offset start, without its newline
+static size_t history_entry_len(size_t start) {
+    const char *newline = memchr(history.map + start, '\n', history.complete_len - start);
+    return newline - (history.map + start);
+}
+
+//Offset of the entry before the one starting at start, which must be above 0
+static size_t history_prev(size_t start) {
+    const char *newline = memrchr(history.map, '\n', start - 1);
+    return newline != NULL ? (size_t)(newline + 1 - history.map) : 0;
+}
+
+//Append a line with a single O_APPEND write so concurrent shells never interleave entries
+void add_history(const char *line) {
+    size_t len = strcspn(line, "\n");
+    if (len == 0 || line[0] == ' ' || history.fd < 0) {
+        return;
+    }
+    refresh_history();
+    if (history.complete_len > 0) {
+        size_t last = history_prev(history.complete_len);
+        if (history_entry_len(last) == len && memcmp(history.map + last, line, len) == 0) {
+            return;
+        }
+    }
+    char entry[MAX_CMD_LENGTH + 1];
+    memcpy(entry, line, len);
+    entry[len] = '\n';
+    if (write(history.fd, entry, len + 1) < 0) {
+        fprintf(stderr, "Error: History: %s\n", strerror(errno));
+    }
+}
+
+//Find the last occurrence of needle in the first len bytes of haystack, or -1. SSE2 compares the
+//needle's first and last byte at 16 positions at once and only candidates are checked with memcmp
+static ssize_t find_last(const char *haystack, size_t len, const char *needle, size_t needle_len) {
+    if (needle_len == 0 || needle_len > len) {
+        return -1;
+    }
+    //Candidates are the start positions below end
+    size_t end = len - needle_len + 1;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    while (end >= 16) {
+        size_t block = end - 16;
+        __m128i starts = _mm_loadu_si128((const __m128i *)(haystack + block));
+        __m128i ends = _mm_loadu_si128((const __m128i *)(haystack + block + needle_len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(starts, first), _mm_cmpeq_epi8(ends, last)));
+        while (mask != 0) {
+            int bit = 31 - __builtin_clz(mask);
+            if (memcmp(haystack + block + bit, needle, needle_len) == 0) {
+                return block + bit;
+            }
+            mask &= ~(1u << bit);
+        }
+        end = block;
+    }
+#endif
+    while (end > 0) {
+        end--;
+        if (haystack[end] == needle[0] && memcmp(haystack + end, needle, needle_len) == 0) {
+            return end;
+        }
+    }
+    return -1;
+}
+
+//Start of the newest entry containing query within the first limit bytes, or -1. The
+//query has no newline, so a match in the mapped file never spans two entries
+static ssize_t search_history(const char *query, size_t limit) {
+    if (limit > history.complete_len) {
+        limit = history.complete_len;
+    }
+    ssize_t pos = find_last(history.map, limit, query, strlen(query));
+    if (pos < 0) {
+        return -1;
+    }
+    const char *newline = pos > 0 ? memrchr(history.map, '\n', pos) : NULL;
+    return newline != NULL ? newline + 1 - history.map : 0;
+}
+
+//Columns the prompt takes on the terminal: escape sequences take none and a multibyte
+//UTF-8 character takes one
+static size_t prompt_width(const char *prompt) {
+    size_t width = 0;
+    for (const unsigned char *c = (const unsigned char *)prompt; *c != '\0'; c++) {
+        if (*c == 27 && c[1] == '[') {
+            //CSI: parameters up to a final byte in @..~
+            c += 2;
+            while (*c != '\0' && (*c < 0x40 || *c > 0x7e)) c++;
+        } else if (*c == 27 && c[1] == ']') {
+            //OSC, such as a window title: up to BEL or ESC backslash
+            c += 2;
+            while (*c != '\0' && *c != 7 && !(*c == 27 && c[1] == '\\')) c++;
+            if (*c == 27) c++;
+        } else if (*c == 27) {
+            if (c[1] != '\0') c++;
+        } else if (*c >= 32 && *c != 127 && (*c & 0xc0) != 0x80) {
+            width++;
+        }
+        if (*c == '\0') {
+            break;
+        }
+    }
+    return width;
+}
+
+//Redraw the edited line after a prompt of the given width and put the cursor at pos.
+//Returns -1 if the terminal can't be written
+static int redraw_line(const char *prompt, size_t width, const char *buf, size_t len, size_t pos) {
+    char out[MAX_CMD_LENGTH * 2 + 64];
+    int n = snprintf(out, sizeof(out), "\r%s%.*s\033[K\r", prompt, (int)len, buf);
+    size_t column = width + pos;
+    if (column > 0 && n < (int)sizeof(out) - 16) {
+        n += snprintf(out + n, sizeof(out) - n, "\033[%zuC", column);
+    }
+    if (write(STDOUT_FILENO, out, n) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+//Read one key, decoding arrow and Home/End escape sequences. Returns -1 at end of input
+//KEY_REFRESH means prompt_thread has new prompt segments
+enum { KEY_UP = 1000, KEY_DOWN, KEY_LEFT, KEY_RIGHT, KEY_HOME, KEY_END, KEY_DELETE, KEY_REFRESH };
+
+static int read_key() {
+    unsigned char c;
+    ssize_t n;
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = prompt_notify[0], .events = POLLIN },
+    };
+    while (poll(fds, 2, -1) < 0 && errno == EINTR);
+    if (fds[1].revents & POLLIN) {
+        char drain[64];
+        while (read(prompt_notify[0], drain, sizeof(drain)) > 0);
+        return KEY_REFRESH;
+    }
+    while ((n = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR);
+    if (n <= 0) {
+        return -1;
+    }
+    if (c != 27) {
+        return c;
+    }
+
+    //A lone Escape has nothing following it within 50ms
+    struct pollfd input = { .fd = STDIN_FILENO, .events = POLLIN };
+    unsigned char seq[3];
+    if (poll(&input, 1, 50) <= 0 || read(STDIN_FILENO, &seq[0], 1) != 1) return 27;
+    if (poll(&input, 1, 50) <= 0 || read(STDIN_FILENO, &seq[1], 1) != 1) return 27;
+    if (seq[0] == '[' && seq[1] >= '0' && seq[1] <= '9') {
+        if (read(STDIN_FILENO, &seq[2], 1) != 1 || seq[2] != '~') return 27;
+        switch (seq[1]) {
+            case '1': case '7': return KEY_HOME;
+            case '4': case '8': return KEY_END;
+            case '3': return KEY_DELETE;
+        }
+        return 27;
+    }
+    switch (seq[1]) {
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+    }
+    return 27;
+}
+
+//Incremental reverse search started with Ctrl-R. Returns the key that ended it,
+//leaving the chosen entry in buf (or the original line if the search was cancelled)
+static int reverse_search(char *buf, size_t size, size_t *len) {
+    char query[MAX_CMD_LENGTH] = "";
+    size_t query_len = 0;
+    char original[MAX_CMD_LENGTH];
+    memcpy(original, buf, *len);
+    size_t original_len = *len;
+    ssize_t match = -1;
+
+    refresh_history();
+    while (1) {
+        char out[MAX_CMD_LENGTH * 2 + 64];
+        int n = snprintf(out, sizeof(out), "\r(reverse-i-search)`%s': %.*s\033[K", query, (int)*len, buf);
+        if (write(STDOUT_FILENO, out, n) < 0) {
+            return -1;
+        }
+
+        int key = read_key();
+        if (key == KEY_REFRESH) {
+            continue;
+        }
+        if (key == 18 || (key >= 32 && key < 127) || key == 127 || key == 8) {
+            size_t limit = history.complete_len;
+            if (key == 18) {
+                //Ctrl-R again: continue with older entries
+                limit = match >= 0 ? (size_t)match : history.complete_len;
+            } else if (key == 127 || key == 8) {
+                if (query_len > 0) query[--query_len] = '\0';
+            } else if (query_len < sizeof(query) - 1) {
+                query[query_len++] = key;
+                query[query_len] = '\0';
+                limit = match >= 0 ? match + history_entry_len(match) : history.complete_len;
+            }
+            ssize_t found = query_len > 0 ? search_history(query, limit) : -1;
+            if (found >= 0) {
+                match = found;
+                *len = history_entry_len(match) < size - 1 ? history_entry_len(match) : size - 1;
+                memcpy(buf, history.map + match, *len);
+            }
+            continue;
+        }
+        if (key == 7 || key == 3) {
+            //Ctrl-G or Ctrl-C restores the line being edited
+            memcpy(buf, original, original_len);
+            *len = original_len;
+        }
+        return key;
+    }
+}
+
+//Read a line from the terminal in raw mode with editing, history and Ctrl-R search.
+//The line is stored like fgets, with a trailing newline. Returns NULL at end of input,
+//which includes a terminal that can no longer be written
+char *edit_line(const char *prompt, char *buf, size_t size) {
+    struct termios saved, raw;
+    if (tcgetattr(STDIN_FILENO, &saved) < 0) {
+        return fgets(buf, size, stdin);
+    }
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    refresh_history();
+    size_t width = prompt_width(prompt);
+    size_t len = 0, pos = 0;
+    size_t browse = history.complete_len; // Entry shown by Up/Down, the end for the new line
+    char pending[MAX_CMD_LENGTH];      // The new line while browsing history
+    size_t pending_len = 0;
+    char *result = buf;
+
+    while (1) {
+        if (redraw_line(prompt, width, buf, len, pos) < 0) {
+            result = NULL;
+            break;
+        }
+        int key = read_key();
+        if (key == 18) {
+            key = reverse_search(buf, size - 1, &len);
+            pos = len;
+            if (key == 13 || key == 10) {
+                break;
+            }
+            if (key == 7 || key == 3 || key == 27) {
+                continue;
+            }
+        }
+
+        if (key == -1 || (key == 4 && len == 0)) {
+            //End of input, or Ctrl-D on an empty line
+            result = NULL;
+            break;
+        } else if (key == 13 || key == 10) {
+            break;
+        } else if (key == 3) {
+            //Ctrl-C discards the line and the next redraw starts a fresh one
+            len = pos = 0;
+            browse = history.complete_len;
+            if (write(STDOUT_FILENO, "^C\r\n", 4) < 0) {
+                result = NULL;
+                break;
+            }
+        } else if ((key == 127 || key == 8) && pos > 0) {
+            memmove(buf + pos - 1, buf + pos, len - pos);
+            pos--;
+            len--;
+        } else if ((key == KEY_DELETE || key == 4) && pos < len) {
+            memmove(buf + pos, buf + pos + 1, len - pos - 1);
+            len--;
+        } else if (key == KEY_LEFT || key == 2) {
+            if (pos > 0) pos--;
+        } else if (key == KEY_RIGHT || key == 6) {
+            if (pos < len) pos++;
+        } else if (key == KEY_HOME || key == 1) {
+            pos = 0;
+        } else if (key == KEY_END || key == 5) {
+            pos = len;
+        } else if (key == 11) {
+            //Ctrl-K kills to the end of the line
+            len = pos;
+        } else if (key == 21) {
+            //Ctrl-U kills to the start of the line
+            memmove(buf, buf + pos, len - pos);
+            len -= pos;
+            pos = 0;
+        } else if (key == 23) {
+            //Ctrl-W deletes the word before the cursor
+            size_t start = pos;
+            while (start > 0 && buf[start - 1] == ' ') start--;
+            while (start > 0 && buf[start - 1] != ' ') start--;
+            memmove(buf + start, buf + pos, len - pos);
+            len -= pos - start;
+            pos = start;
+        } else if (key == KEY_REFRESH) {
+            //Redraw from the cache: asking for another refresh here would rerun git forever
+            prompt = render_prompt(0);
+            width = prompt_width(prompt);
+        } else if (key == 9) {
+            //The bell rings when nothing was completed
+            int candidates = complete_command(buf, size - 2, &len, &pos);
+            if (candidates <= 0 && write(STDOUT_FILENO, "\a", 1) < 0) {
+                result = NULL;
+                break;
+            }
+        } else if (key == 12) {
+            if (write(STDOUT_FILENO, "\033[H\033[2J", 7) < 0) {
+                result = NULL;
+                break;
+            }
+        } else if (key == KEY_UP || key == 16 || key == KEY_DOWN || key == 14) {
+            //Entries other shells append while browsing come after the new line
+            int on_new_line = browse == history.complete_len;
+            refresh_history();
+            if (on_new_line || browse > history.complete_len || (browse > 0 && history.map[browse - 1] != '\n')) {
+                browse = history.complete_len;
+            }
+            if (browse == history.complete_len) {
+                memcpy(pending, buf, len);
+                pending_len = len;
+            }
+            if ((key == KEY_UP || key == 16) && browse > 0) {
+                browse = history_prev(browse);
+            } else if ((key == KEY_DOWN || key == 14) && browse < history.complete_len) {
+                browse += history_entry_len(browse) + 1;
+            } else {
+                continue;
+            }
+            if (browse == history.complete_len) {
+                memcpy(buf, pending, pending_len);
+                len = pending_len;
+            } else {
+                len = history_entry_len(browse) < size - 2 ? history_entry_len(browse) : size - 2;
+                memcpy(buf, history.map + browse, len);
+            }
+            pos = len;
+        } else if (key >= 32 && key < 127 && len < size - 2) {
+            memmove(buf + pos + 1, buf + pos, len - pos);
+            buf[pos++] = key;
+            len++;
+        }
+    }
+
+    if (result != NULL && redraw_line(prompt, width, buf, len, len) < 0) {
+        result = NULL;
+    }
+    if (result != NULL) {
+        buf[len++] = '\n';
+        buf[len] = '\0';
+    } else {
+        buf[0] = '\0';
+    }
+    if (write(STDOUT_FILENO, "\r\n", 2) < 0) {
+        result = NULL;
+    }
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+    return result;
+}
+
+//history [N]: print the last N entries of the shared history
+int builtin_history(char **args) {
+    refresh_history();
+    //Entries are numbered, so the whole file is counted once and kept up by refresh_history
+    if (history.count < 0) {
+        history.count = 0;
+        for (const char *p = history.map, *end = p + history.complete_len; p < end; p = (char *)memchr(p, '\n', end - p) + 1) {
+            history.count++;
+        }
+    }
+    size_t count = args[1] != NULL ? strtoul(args[1], NULL, 10) : (size_t)history.count;
+    if (count > (size_t)history.count) {
+        count = history.count;
+    }
+    size_t start = history.complete_len;
+    for (size_t i = 0; i < count; i++) {
+        start = history_prev(start);
+    }
+    for (size_t i = history.count - count + 1; start < history.complete_len; i++) {
+        size_t entry_len = history_entry_len(start);
+        printf("%6zu  %.*s\n", i, (int)entry_len, history.map + start);
+        start += entry_len + 1;
+    }
+    return 0;
+}
+
+//Entry layout returned by getdents64
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+//Read every entry of a directory except . and .. with large getdents64 batches.
+//Returns 0 on success
+int read_directory(int dir_fd, DirListing *listing) {
+    char buf[64 * 1024];
+    listing->len = 0;
+    listing->count = 0;
+    while (1) {
+        long n = syscall(SYS_getdents64, dir_fd, buf, sizeof(buf));
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        for (long off = 0; off < n; ) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buf + off);
+            off += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            size_t name_len = strlen(name);
+            if (listing->len + name_len + 2 > listing->capacity) {
+                listing->capacity = (listing->capacity + name_len + 2) * 2;
+                listing->data = realloc(listing->data, listing->capacity);
+            }
+            listing->data[listing->len++] = entry->d_type;
+            memcpy(listing->data + listing->len, name, name_len + 1);
+            listing->len += name_len + 1;
+            listing->count++;
+        }
+    }
+}
+
+//Find or add the child of node for character c. Called with completion_lock held
+static int trie_child(int node, char c, int create) {
+    int prev = -1;
+    for (int child = trie[node].child; child >= 0; child = trie[child].sibling) {
+        if (trie[child].c == c) {
+            return child;
+        }
+        prev = child;
+    }
+    if (!create) {
+        return -1;
+    }
+    if (trie_size == trie_capacity) {
+        trie_capacity = trie_capacity ? trie_capacity * 2 : 4096;
+        trie = realloc(trie, trie_capacity * sizeof(TrieNode));
+    }
+    int added = trie_size++;
+    trie[added] = (TrieNode) { .c = c, .child = -1, .sibling = -1, .count = 0 };
+    if (prev < 0) {
+        trie[node].child = added;
+    } else {
+        trie[prev].sibling = added;
+    }
+    return added;
+}
+
+//Add (delta 1) or remove (delta -1) every name of a listing. Called with completion_lock held
+static void trie_apply(const DirListing *listing, int delta) {
+    for (size_t off = 0; off < listing->len; ) {
+        const char *name = listing->data + off + 1;
+        int node = 0;
+        for (const char *c = name; *c != '\0'; c++) {
+            node = trie_child(node, *c, 1);
+        }
+        trie[node].count += delta;
+        off += strlen(name) + 2;
+    }
+}
+
+//Rescan one PATH directory and swap its names in the trie
+static void scan_path_dir(int index) {
+    DirListing listing = { 0 }, executables = { 0 };
+    int dir_fd = open(path_dirs[index], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0 && read_directory(dir_fd, &listing) == 0) {
+        //Keep regular files and links that are executable; d_type avoids a stat for directories
+        for (size_t off = 0; off < listing.len; ) {
+            unsigned char type = listing.data[off];
+            const char *name = listing.data + off + 1;
+            size_t entry_len = strlen(name) + 2;
+            if (type != DT_DIR && faccessat(dir_fd, name, X_OK, 0) == 0) {
+                if (executables.len + entry_len > executables.capacity) {
+                    executables.capacity = (executables.capacity + entry_len) * 2;
+                    executables.data = realloc(executables.data, executables.capacity);
+                }
+                memcpy(executables.data + executables.len, listing.data + off, entry_len);
+                executables.len += entry_len;
+                executables.count++;
+            }
+            off += entry_len;
+        }
+    }
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+    free(listing.data);
+
+    pthread_mutex_lock(&completion_lock);
+    trie_apply(&path_listings[index], -1);
+    trie_apply(&executables, 1);
+    free(path_listings[index].data);
+    path_listings[index] = executables;
+    pthread_mutex_unlock(&completion_lock);
+}
+
+//Build the trie, then keep each directory current from inotify events (or mtimes without inotify)
+void *completion_thread(void *arg) {
+    (void)arg;
+    for (int i = 0; i < num_path_dirs; i++) {
+        scan_path_dir(i);
+    }
+
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    int *watches = calloc(num_path_dirs, sizeof(int));
+    struct timespec *mtimes = calloc(num_path_dirs, sizeof(struct timespec));
+    for (int i = 0; i < num_path_dirs; i++) {
+        struct stat st;
+        watches[i] = inotify_fd < 0 ? -1 : inotify_add_watch(inotify_fd, path_dirs[i],
+            IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR);
+        if (stat(path_dirs[i], &st) == 0) {
+            mtimes[i] = st.st_mtim;
+        }
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char *stale = calloc(num_path_dirs, 1);
+    while (1) {
+        if (inotify_fd >= 0) {
+            ssize_t n = read(inotify_fd, events, sizeof(events));
+            if (n <= 0) {
+                continue;
+            }
+            for (char *p = events; p < events + n; ) {
+                struct inotify_event *event = (struct inotify_event *)p;
+                for (int i = 0; i < num_path_dirs; i++) {
+                    stale[i] |= watches[i] == event->wd;
+                }
+                p += sizeof(struct inotify_event) + event->len;
+            }
+            //Installs touch many files at once; let the burst settle before rescanning
+            usleep(100000);
+        } else {
+            sleep(2);
+            for (int i = 0; i < num_path_dirs; i++) {
+                struct stat st;
+                if (stat(path_dirs[i], &st) == 0 && (st.st_mtim.tv_sec != mtimes[i].tv_sec ||
+                                                      st.st_mtim.tv_nsec != mtimes[i].tv_nsec)) {
+                    mtimes[i] = st.st_mtim;
+                    stale[i] = 1;
+                }
+            }
+        }
+        for (int i = 0; i < num_path_dirs; i++) {
+            if (stale[i]) {
+                stale[i] = 0;
+                scan_path_dir(i);
+            }
+        }
+    }
+    return NULL;
+}
+
+//Split $PATH and start the background indexer
+void start_completion() {
+    const char *path = getenv("PATH");
+    if (path == NULL) {
+        return;
+    }
+    char *copy = strdup(path);
+    int capacity = 1;
+    for (const char *c = path; *c != '\0'; c++) {
+        capacity += *c == ':';
+    }
+    path_dirs = calloc(capacity, sizeof(char *));
+    path_listings = calloc(capacity, sizeof(DirListing));
+    for (char *save, *dir = strtok_r(copy, ":", &save); dir != NULL; dir = strtok_r(NULL, ":", &save)) {
+        path_dirs[num_path_dirs++] = dir;
+    }
+
+    trie = malloc(4096 * sizeof(TrieNode));
+    trie_capacity = 4096;
+    trie[0] = (TrieNode) { .c = 0, .child = -1, .sibling = -1, .count = 0 };
+    trie_size = 1;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    //Only the indexer runs on this thread; signals stay with the main thread
+    sigset_t all, old_mask;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old_mask);
+    if (pthread_create(&thread, &attr, completion_thread, NULL) != 0) {
+        fprintf(stderr, "Error: Cannot start the completion thread.\n");
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    pthread_attr_destroy(&attr);
+}
+
+//Collect up to max names below node into names; word holds the path so far. Called with completion_lock held
+static void trie_collect(int node, char *word, size_t depth, size_t word_size, char **names, int *count, int max) {
+    if (trie[node].count > 0 && *count < max) {
+        word[depth] = '\0';
+        names[(*count)++] = strdup(word);
+    }
+    for (int child = trie[node].child; child >= 0 && *count < max && depth + 1 < word_size; child = trie[child].sibling) {
+        word[depth] = trie[child].c;
+        trie_collect(child, word, depth + 1, word_size, names, count, max);
+    }
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+//Complete the command name before the cursor from the trie and the builtins.
+//Returns the number of candidates, or -1 if the index is busy or the terminal can't be written
+int complete_command(char *buf, size_t size, size_t *len, size_t *pos) {
+    //Only the first word of a command is completed
+    size_t start = *pos;
+    while (start > 0 && buf[start - 1] != ' ') start--;
+    for (size_t i = start; i > 0; i--) {
+        char c = buf[i - 1];
+        if (c == '|') break;
+        if (c != ' ' && c != '&') return 0;
+    }
+    char prefix[MAX_CMD_LENGTH];
+    size_t prefix_len = *pos - start;
+    memcpy(prefix, buf + start, prefix_len);
+    prefix[prefix_len] = '\0';
+    if (strchr(prefix, '/') != NULL) {
+        return 0;
+    }
+
+    enum { MAX_CANDIDATES = 256 };
+    char *names[MAX_CANDIDATES];
+    int count = 0;
+    if (pthread_mutex_trylock(&completion_lock) != 0) {
+        return -1;
+    }
+    if (trie != NULL) {
+        int node = 0;
+        for (size_t i = 0; i < prefix_len && node >= 0; i++) {
+            node = trie_child(node, prefix[i], 0);
+        }
+        if (node >= 0) {
+            char word[MAX_CMD_LENGTH];
+            memcpy(word, prefix, prefix_len);
+            trie_collect(node, word, prefix_len, sizeof(word), names, &count, MAX_CANDIDATES);
+        }
+    }
+    pthread_mutex_unlock(&completion_lock);
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]) && count < MAX_CANDIDATES; i++) {
+        if (strncmp(builtins[i].name, prefix, prefix_len) == 0) {
+            names[count++] = strdup(builtins[i].name);
+        }
+    }
+    if (count == 0) {
+        return 0;
+    }
+    qsort(names, count, sizeof(char *), compare_names);
+    //A builtin may also exist on $PATH
+    int unique = 1;
+    for (int i = 1; i < count; i++) {
+        if (strcmp(names[i], names[unique - 1]) == 0) {
+            free(names[i]);
+        } else {
+            names[unique++] = names[i];
+        }
+    }
+    count = unique;
+
+    //Extend the word to the longest common prefix, plus a space if it is unique
+    size_t common = strlen(names[0]);
+    for (int i = 1; i < count; i++) {
+        size_t j = 0;
+        while (j < common && names[i][j] == names[0][j]) j++;
+        common = j;
+    }
+    char insert[MAX_CMD_LENGTH];
+    size_t insert_len = common - prefix_len;
+    memcpy(insert, names[0] + prefix_len, insert_len);
+    if (count == 1) {
+        insert[insert_len++] = ' ';
+    }
+    if (*len + insert_len < size) {
+        memmove(buf + *pos + insert_len, buf + *pos, *len - *pos);
+        memcpy(buf + *pos, insert, insert_len);
+        *len += insert_len;
+        *pos += insert_len;
+    }
+
+    //Nothing to add: list the candidates under the line
+    int listed = count;
+    if (insert_len == 0 && count > 1) {
+        if (write(STDOUT_FILENO, "\r\n", 2) < 0) {
+            listed = -1;
+        }
+        for (int i = 0; i < count && listed > 0; i++) {
+            if (write(STDOUT_FILENO, names[i], strlen(names[i])) < 0 || write(STDOUT_FILENO, "  ", 2) < 0) {
+                listed = -1;
+            }
+        }
+        if (listed > 0 && write(STDOUT_FILENO, "\r\n", 2) < 0) {
+            listed = -1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    return listed;
+}
+
+//Name of the branch checked out in the repository containing dir, or "" outside one
+static void read_git_branch(const char *dir, char *branch, size_t size) {
+    char path[PATH_MAX + 16];
+    branch[0] = '\0';
+    snprintf(path, sizeof(path), "%s", dir);
+    while (1) {
+        size_t len = strlen(path);
+        struct stat st;
+        snprintf(path + len, sizeof(path) - len, "/.git");
+        if (stat(path, &st) == 0) {
+            //Worktrees and submodules have a .git file pointing at the real directory
+            if (S_ISREG(st.st_mode)) {
+                FILE *file = fopen(path, "re");
+                char line[PATH_MAX + 16];
+                if (file == NULL || fgets(line, sizeof(line), file) == NULL || strncmp(line, "gitdir: ", 8) != 0) {
+                    if (file) fclose(file);
+                    return;
+                }
+                fclose(file);
+                line[strcspn(line, "\n")] = '\0';
+                if (line[8] == '/') {
+                    snprintf(path, sizeof(path), "%s", line + 8);
+                } else {
+                    snprintf(path + len + 1, sizeof(path) - len - 1, "%s", line + 8);
+                }
+            }
+            size_t git_len = strlen(path);
+            snprintf(path + git_len, sizeof(path) - git_len, "/HEAD");
+            FILE *head = fopen(path, "re");
+            char line[256];
+            if (head == NULL || fgets(line, sizeof(line), head) == NULL) {
+                if (head) fclose(head);
+                snprintf(branch, size, "?");
+                return;
+            }
+            fclose(head);
+            line[strcspn(line, "\n")] = '\0';
+            if (strncmp(line, "ref: refs/heads/", 16) == 0) {
+                snprintf(branch, size, "%.*s", (int)size - 1, line + 16);
+            } else {
+                //Detached HEAD shows the abbreviated commit
+                snprintf(branch, size, "%.7s", line);
+            }
+            return;
+        }
+        path[len] = '\0';
+        char *slash = strrchr(path, '/');
+        if (slash == NULL || len <= 1) {
+            return;
+        }
+        slash[slash == path ? 1 : 0] = '\0';
+    }
+}
+
+//Run 'git status' in dir with environment envp within prompt_budget_ms. Returns 1 if the
+//tree has changes, 0 if clean, -1 if git failed or ran over budget
+static int read_git_dirty(const char *dir, char **envp) {
+    //git runs from a raw clone3 with no exit signal, so the SIGCHLD reaper never sees it. That
+    //child skips fork's lock handling and may only make async-signal-safe calls, unlike job
+    //children (see spawn_process), so git is found on PATH here rather than by execvp. The
+    //shell frees its environ when a variable changes, so only the request's copy is read
+    char git[PATH_MAX];
+    const char *path = NULL;
+    for (char **env = envp; path == NULL && env != NULL && *env != NULL; env++) {
+        if (strncmp(*env, "PATH=", 5) == 0) {
+            path = *env + 5;
+        }
+    }
+    int found = 0;
+    while (!found && path != NULL && *path != '\0') {
+        size_t len = strcspn(path, ":");
+        if (snprintf(git, sizeof(git), "%.*s/git", (int)len, path) < (int)sizeof(git)) {
+            found = access(git, X_OK) == 0;
+        }
+        path += len + (path[len] == ':');
+    }
+    if (!found) {
+        return -1;
+    }
+
+    int out[2];
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    char *argv[] = { "git", "--no-optional-locks", "status", "--porcelain", "--untracked-files=no", NULL };
+#if defined(CLONE_PIDFD)
+    //No exit signal: the child is invisible to the SIGCHLD handler's wait4(-1)
+    int pidfd = -1;
+    struct clone_args args = {
+        .flags = CLONE_PIDFD,
+        .pidfd = (uint64_t)(uintptr_t)&pidfd,
+        .exit_signal = 0,
+    };
+    pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+#else
+    pid_t pid = -1;
+    int pidfd = -1;
+#endif
+    if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        dup2(null_fd, STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (chdir(dir) == 0) {
+            execve(git, argv, envp);
+        }
+        _exit(127);
+    }
+    close(out[1]);
+    if (null_fd >= 0) {
+        close(null_fd);
+    }
+    if (pid < 0) {
+        close(out[0]);
+        return -1;
+    }
+
+    //Any output line is a change, so stop as soon as one arrives
+    int dirty = -1, exited = 0;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct pollfd fds[2] = { { .fd = out[0], .events = POLLIN }, { .fd = pidfd, .events = POLLIN } };
+    while (dirty < 0 && !exited) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int left = prompt_budget_ms - (int)(elapsed_ns(&start, &now) / 1000000);
+        if (left <= 0 || poll(fds, 2, left) <= 0) {
+            break;
+        }
+        if (fds[0].revents) {
+            char c;
+            ssize_t n = read(out[0], &c, 1);
+            if (n == 1) {
+                dirty = 1;
+            } else if (n == 0) {
+                fds[0].fd = -1;
+            }
+        }
+        exited = fds[1].revents != 0;
+    }
+    int status;
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, __WCLONE);
+    if (dirty < 0 && exited && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        //Exited cleanly; drain anything written just before exit
+        char c;
+        dirty = read(out[0], &c, 1) == 1;
+    }
+    close(out[0]);
+    close(pidfd);
+    return dirty;
+}
+
+//Refresh the git state of requested directories, then wake up the line editor
+void *prompt_thread(void *arg) {
+    (void)arg;
+    char dir[PATH_MAX], branch[64];
+    char **envp = NULL;
+    while (1) {
+        pthread_mutex_lock(&prompt_lock);
+        while (prompt_request[0] == '\0') {
+            pthread_cond_wait(&prompt_wakeup, &prompt_lock);
+        }
+        snprintf(dir, sizeof(dir), "%s", prompt_request);
+        prompt_request[0] = '\0';
+        free(envp);
+        envp = prompt_request_envp;
+        prompt_request_envp = NULL;
+        pthread_mutex_unlock(&prompt_lock);
+
+        //The branch is a file read and is published before the slower status
+        read_git_branch(dir, branch, sizeof(branch));
+        for (int pass = 0; pass < 2; pass++) {
+            int dirty = pass == 0 ? -1 : (branch[0] != '\0' ? read_git_dirty(dir, envp) : 0);
+            int changed = 0;
+            pthread_mutex_lock(&prompt_lock);
+            for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+                GitState *state = &prompt_cache[i];
+                if (strcmp(state->dir, dir) != 0) {
+                    continue;
+                }
+                changed = strcmp(state->branch, branch) != 0 || (pass == 1 && state->dirty != dirty);
+                snprintf(state->branch, sizeof(state->branch), "%s", branch);
+                //Keep the old dirty flag shown until the new one is known
+                if (pass == 1 || changed) {
+                    state->dirty = dirty;
+                }
+            }
+            pthread_mutex_unlock(&prompt_lock);
+            if (changed && write(prompt_notify[1], "", 1) < 0) {
+                //The pipe is full: a redraw is already pending
+            }
+            if (branch[0] == '\0') {
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+//Copy an environment into one allocation, pointers first and then the strings
+static char **copy_envp(char **envp) {
+    size_t count = 0, bytes = 0;
+    for (; envp[count] != NULL; count++) {
+        bytes += strlen(envp[count]) + 1;
+    }
+    char **copy = malloc((count + 1) * sizeof(char *) + bytes);
+    char *strings = (char *)(copy + count + 1);
+    for (size_t i = 0; i < count; i++) {
+        copy[i] = strings;
+        strings = stpcpy(strings, envp[i]) + 1;
+    }
+    copy[count] = NULL;
+    return copy;
+}
+
+//Look up the cached git state of dir. prompt_thread is asked to refresh it for a new prompt
+//(refresh set) or when dir is not the directory refreshed last
+static void lookup_git_state(const char *dir, int refresh, char *branch, size_t size, int *dirty) {
+    static char refreshed_dir[PATH_MAX];
+    pthread_mutex_lock(&prompt_lock);
+    if (!prompt_thread_started) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        sigset_t all, old_mask;
+        if (pipe2(prompt_notify, O_CLOEXEC | O_NONBLOCK) == 0) {
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            sigfillset(&all);
+            pthread_sigmask(SIG_BLOCK, &all, &old_mask);
+            prompt_thread_started = pthread_create(&thread, &attr, prompt_thread, NULL) == 0;
+            pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+            pthread_attr_destroy(&attr);
+        }
+        if (!prompt_thread_started) {
+            fprintf(stderr, "Error: Cannot start the prompt thread.\n");
+            prompt_thread_started = -1;
+        }
+    }
+
+    GitState *state = NULL, *oldest = &prompt_cache[0];
+    for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+        if (strcmp(prompt_cache[i].dir, dir) == 0) {
+            state = &prompt_cache[i];
+            break;
+        }
+        if (prompt_cache[i].used < oldest->used) {
+            oldest = &prompt_cache[i];
+        }
+    }
+    if (state == NULL) {
+        state = oldest;
+        snprintf(state->dir, sizeof(state->dir), "%s", dir);
+        state->branch[0] = '\0';
+        state->dirty = 0;
+    }
+    state->used = ++prompt_counter;
+    snprintf(branch, size, "%s", state->branch);
+    *dirty = state->dirty;
+
+    if (prompt_thread_started > 0 && (refresh || strcmp(dir, refreshed_dir) != 0)) {
+        snprintf(refreshed_dir, sizeof(refreshed_dir), "%s", dir);
+        snprintf(prompt_request, sizeof(prompt_request), "%s", dir);
+        //prompt_thread never reads environ, which the shell frees when a variable changes
+        free(prompt_request_envp);
+        prompt_request_envp = copy_envp(current_envp());
+        pthread_cond_signal(&prompt_wakeup);
+    }
+    pthread_mutex_unlock(&prompt_lock);
+}
+
+//Expand prompt_format. Cheap segments are computed here, git state comes from the cache:
+//  %~ working directory with $HOME as ~   %c last component of the working directory
+//  %? last exit status                    %j running background jobs
+//  %d duration of the last command        %g git branch, with * if dirty and ? if unknown
+//  %% a literal %
+//A git refresh is requested only with refresh set, for a newly printed prompt; redraws use the cache
+const char *render_prompt(int refresh) {
+    static char prompt[MAX_CMD_LENGTH];
+    char cwd[PATH_MAX], segment[PATH_MAX + 8];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        snprintf(cwd, sizeof(cwd), "?");
+    }
+    size_t len = 0;
+    for (const char *c = prompt_format; *c != '\0' && len < sizeof(prompt) - 1; c++) {
+        if (*c != '%' || c[1] == '\0') {
+            prompt[len++] = *c;
+            continue;
+        }
+        segment[0] = '\0';
+        const char *home = getenv("HOME");
+        size_t home_len = home != NULL ? strlen(home) : 0;
+        switch (*++c) {
+            case '~':
+                if (home_len > 1 && strncmp(cwd, home, home_len) == 0 && (cwd[home_len] == '/' || cwd[home_len] == '\0')) {
+                    snprintf(segment, sizeof(segment), "~%s", cwd + home_len);
+                } else {
+                    snprintf(segment, sizeof(segment), "%s", cwd);
+                }
+                break;
+            case 'c': {
+                const char *slash = strrchr(cwd, '/');
+                snprintf(segment, sizeof(segment), "%s", slash != NULL && slash[1] != '\0' ? slash + 1 : cwd);
+                break;
+            }
+            case '?':
+                snprintf(segment, sizeof(segment), "%d", last_status);
+                break;
+            case 'j':
+                snprintf(segment, sizeof(segment), "%d", count_background_jobs());
+                break;
+            case 'd':
+                if (last_duration_ns >= 60000000000ull) {
+                    snprintf(segment, sizeof(segment), "%llum%02llus", (unsigned long long)(last_duration_ns / 60000000000ull),
+                             (unsigned long long)(last_duration_ns / 1000000000ull % 60));
+                } else if (last_duration_ns >= 1000000000ull) {
+                    snprintf(segment, sizeof(segment), "%.1fs", last_duration_ns / 1e9);
+                } else {
+                    snprintf(segment, sizeof(segment), "%llums", (unsigned long long)(last_duration_ns / 1000000));
+                }
+                break;
+            case 'g': {
+                char branch[64];
+                int dirty;
+                lookup_git_state(cwd, refresh, branch, sizeof(branch), &dirty);
+                if (branch[0] != '\0') {
+                    snprintf(segment, sizeof(segment), "%s%s", branch, dirty > 0 ? "*" : dirty < 0 ? "?" : "");
+                }
+                break;
+            }
+            default:
+                snprintf(segment, sizeof(segment), "%c", *c);
+        }
+        size_t segment_len = strlen(segment);
+        if (len + segment_len >= sizeof(prompt)) {
+            segment_len = sizeof(prompt) - 1 - len;
+        }
+        memcpy(prompt + len, segment, segment_len);
+        len += segment_len;
+    }
+    prompt[len] = '\0';
+    return prompt;
+}
+
+//Set the prompt: 'prompt FORMAT...' joins the words with spaces and adds a trailing space,
+//'prompt -b MS' sets the git status budget, 'prompt' prints the current format
+int builtin_prompt(char **args) {
+    if (args[1] == NULL) {
+        printf("%s\n", prompt_format);
+        return 0;
+    }
+    if (strcmp(args[1], "-b") == 0) {
+        if (args[2] == NULL || atoi(args[2]) <= 0) {
+            fprintf(stderr, "Error: Usage: prompt -b MILLISECONDS\n");
+            return 1;
+        }
+        pthread_mutex_lock(&prompt_lock);
+        prompt_budget_ms = atoi(args[2]);
+        pthread_mutex_unlock(&prompt_lock);
+        return 0;
+    }
+    size_t len = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        len += snprintf(prompt_format + len, sizeof(prompt_format) - len, "%s ", args[i]);
+        if (len >= sizeof(prompt_format)) {
+            len = sizeof(prompt_format) - 1;
+            break;
+        }
+    }
+    return 0;
+}
+
+//Change the working directory of the shell, to $HOME without an argument
+int builtin_cd(char **args) {
+    const char *dir = args[1] != NULL ? args[1] : getenv("HOME");
+    if (dir == NULL) {
+        fprintf(stderr, "Error: cd: HOME is not set\n");
+        return 1;
+    }
+    if (chdir(dir) < 0) {
+        fprintf(stderr, "Error: cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+//Get the listing of dir from the cache, reading it with getdents64 if it is missing or stale.
+//Returns NULL if the directory cannot be read; release the result with release_listing
+static SharedListing *get_listing(const char *dir) {
+    struct stat st;
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&dir_cache_lock);
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        DirCacheEntry *entry = &dir_cache[i];
+        //A listing read in the same second as the last change may have missed it
+        if (entry->shared != NULL && entry->ino == st.st_ino && entry->dev == st.st_dev &&
+            entry->mtime.tv_sec == st.st_mtim.tv_sec && entry->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+            entry->listed > st.st_mtim.tv_sec + 1 && strcmp(entry->path, dir) == 0) {
+            entry->used = ++dir_cache_counter;
+            entry->shared->refs++;
+            SharedListing *shared = entry->shared;
+            pthread_mutex_unlock(&dir_cache_lock);
+            return shared;
+        }
+    }
+    pthread_mutex_unlock(&dir_cache_lock);
+
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return NULL;
+    }
+    time_t listed = time(NULL);
+    SharedListing *shared = calloc(1, sizeof(SharedListing));
+    int failed = read_directory(dir_fd, &shared->listing) < 0;
+    close(dir_fd);
+    if (failed || strlen(dir) >= PATH_MAX) {
+        free(shared->listing.data);
+        free(shared);
+        return NULL;
+    }
+
+    //One reference for the cache and one for the caller
+    shared->refs = 2;
+    pthread_mutex_lock(&dir_cache_lock);
+    DirCacheEntry *slot = &dir_cache[0];
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (strcmp(dir_cache[i].path, dir) == 0 || dir_cache[i].shared == NULL) {
+            slot = &dir_cache[i];
+            break;
+        }
+        if (dir_cache[i].used < slot->used) {
+            slot = &dir_cache[i];
+        }
+    }
+    if (slot->shared != NULL && --slot->shared->refs == 0) {
+        free(slot->shared->listing.data);
+        free(slot->shared);
+    }
+    snprintf(slot->path, sizeof(slot->path), "%s", dir);
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtim;
+    slot->listed = listed;
+    slot->shared = shared;
+    slot->used = ++dir_cache_counter;
+    pthread_mutex_unlock(&dir_cache_lock);
+    return shared;
+}
+
+static void release_listing(SharedListing *shared) {
+    pthread_mutex_lock(&dir_cache_lock);
+    if (--shared->refs == 0) {
+        free(shared->listing.data);
+        free(shared);
+    }
+    pthread_mutex_unlock(&dir_cache_lock);
+}
+
+//Join a directory and a name; an empty base is the working directory
+static void join_path(char *out, size_t size, const char *base, const char *name) {
+    if (base[0] == '\0') {
+        snprintf(out, size, "%s", name);
+    } else {
+        snprintf(out, size, "%s%s%s", base, base[strlen(base) - 1] == '/' ? "" : "/", name);
+    }
+}
+
+//Whether the entry is a directory, with a stat only when d_type cannot tell
+static int entry_is_dir(const char *base, const char *name, unsigned char type, int follow) {
+    if (type == DT_DIR) {
+        return 1;
+    }
+    if (type != DT_UNKNOWN && (type != DT_LNK || !follow)) {
+        return 0;
+    }
+    char path[PATH_MAX];
+    struct stat st;
+    join_path(path, sizeof(path), base, name);
+    return (follow ? stat(path, &st) : lstat(path, &st)) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void glob_add(GlobResults *results, const char *path, int dir_only) {
+    if (results->count == results->capacity) {
+        results->capacity = results->capacity ? results->capacity * 2 : 64;
+        results->paths = realloc(results->paths, results->capacity * sizeof(char *));
+    }
+    if (dir_only) {
+        size_t len = strlen(path);
+        char *with_slash = malloc(len + 2);
+        memcpy(with_slash, path, len);
+        memcpy(with_slash + len, "/", 2);
+        results->paths[results->count++] = with_slash;
+    } else {
+        results->paths[results->count++] = strdup(path);
+    }
+}
+
+static void glob_match(const char *base, char **comps, int num_comps, int dir_only, GlobResults *results, int parallel);
+
+//Visit directories of a '**' walk until none are left, matching the rest of the pattern in each
+static void glob_walk(GlobWalk *walk) {
+    GlobResults local = { 0 };
+    pthread_mutex_lock(&walk->lock);
+    while (1) {
+        while (walk->num_dirs == 0 && walk->busy > 0) {
+            pthread_cond_wait(&walk->more, &walk->lock);
+        }
+        if (walk->num_dirs == 0) {
+            break;
+        }
+        char *dir = walk->dirs[--walk->num_dirs];
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        glob_match(dir, walk->comps, walk->num_comps, walk->dir_only, &local, 0);
+        char **subdirs = NULL;
+        int num_subdirs = 0;
+        SharedListing *shared = get_listing(dir[0] != '\0' ? dir : ".");
+        if (shared != NULL) {
+            const DirListing *listing = &shared->listing;
+            subdirs = malloc(listing->count * sizeof(char *));
+            for (size_t off = 0; off < listing->len; ) {
+                unsigned char type = listing->data[off];
+                const char *name = listing->data + off + 1;
+                off += strlen(name) + 2;
+                //Like bash, '**' skips hidden directories and matches inside linked ones without descending
+                if (name[0] == '.') {
+                    continue;
+                }
+                char path[PATH_MAX];
+                join_path(path, sizeof(path), dir, name);
+                if (entry_is_dir(dir, name, type, 0)) {
+                    subdirs[num_subdirs++] = strdup(path);
+                } else if (type == DT_LNK && entry_is_dir(dir, name, type, 1)) {
+                    glob_match(path, walk->comps, walk->num_comps, walk->dir_only, &local, 0);
+                }
+            }
+            release_listing(shared);
+        }
+        free(dir);
+
+        pthread_mutex_lock(&walk->lock);
+        if (walk->num_dirs + num_subdirs > walk->capacity) {
+            walk->capacity = (walk->num_dirs + num_subdirs) * 2;
+            walk->dirs = realloc(walk->dirs, walk->capacity * sizeof(char *));
+        }
+        memcpy(walk->dirs + walk->num_dirs, subdirs, num_subdirs * sizeof(char *));
+        walk->num_dirs += num_subdirs;
+        walk->busy--;
+        free(subdirs);
+        pthread_cond_broadcast(&walk->more);
+    }
+    //Merge what this thread found
+    for (int i = 0; i < local.count; i++) {
+        if (walk->results.count == walk->results.capacity) {
+            walk->results.capacity = walk->results.capacity ? walk->results.capacity * 2 : 64;
+            walk->results.paths = realloc(walk->results.paths, walk->results.capacity * sizeof(char *));
+        }
+        walk->results.paths[walk->results.count++] = local.paths[i];
+    }
+    pthread_cond_broadcast(&walk->more);
+    pthread_mutex_unlock(&walk->lock);
+    free(local.paths);
+}
+
+static void *glob_pool_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&glob_pool_lock);
+    unsigned seen = glob_pool_generation;
+    while (1) {
+        while (glob_pool_generation == seen) {
+            pthread_cond_wait(&glob_pool_wakeup, &glob_pool_lock);
+        }
+        seen = glob_pool_generation;
+        GlobWalk *walk = glob_pool_walk;
+        if (walk == NULL) {
+            continue;
+        }
+        glob_pool_active++;
+        pthread_mutex_unlock(&glob_pool_lock);
+        glob_walk(walk);
+        pthread_mutex_lock(&glob_pool_lock);
+        glob_pool_active--;
+        pthread_cond_signal(&glob_pool_idle);
+    }
+    return NULL;
+}
+
+//Run a '**' walk from base, on the glob pool when there is more than one CPU
+static void glob_recursive(const char *base, char **comps, int num_comps, int dir_only, GlobResults *results, int parallel) {
+    GlobWalk walk = { .comps = comps, .num_comps = num_comps, .dir_only = dir_only };
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.more, NULL);
+    walk.capacity = 64;
+    walk.dirs = malloc(walk.capacity * sizeof(char *));
+    walk.dirs[walk.num_dirs++] = strdup(base);
+
+    pthread_mutex_lock(&glob_pool_lock);
+    if (parallel && glob_pool_size < 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        glob_pool_size = 0;
+        sigset_t all, old_mask;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old_mask);
+        for (long i = 1; i < cpus && i < 8; i++) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, glob_pool_thread, NULL) == 0) {
+                pthread_detach(thread);
+                glob_pool_size++;
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    }
+    parallel = parallel && glob_pool_size > 0;
+    if (parallel) {
+        glob_pool_walk = &walk;
+        glob_pool_generation++;
+        pthread_cond_broadcast(&glob_pool_wakeup);
+    }
+    pthread_mutex_unlock(&glob_pool_lock);
+
+    glob_walk(&walk);
+
+    if (parallel) {
+        pthread_mutex_lock(&glob_pool_lock);
+        while (glob_pool_active > 0) {
+            pthread_cond_wait(&glob_pool_idle, &glob_pool_lock);
+        }
+        glob_pool_walk = NULL;
+        pthread_mutex_unlock(&glob_pool_lock);
+    }
+    for (int i = 0; i < walk.results.count; i++) {
+        if (results->count == results->capacity) {
+            results->capacity = results->capacity ? results->capacity * 2 : 64;
+            results->paths = realloc(results->paths, results->capacity * sizeof(char *));
+        }
+        results->paths[results->count++] = walk.results.paths[i];
+    }
+    free(walk.results.paths);
+    free(walk.dirs);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.more);
+}
+
+//Match the pattern components comps below base
+static void glob_match(const char *base, char **comps, int num_comps, int dir_only, GlobResults *results, int parallel) {
+    char path[PATH_MAX];
+    if (num_comps == 0) {
+        if (base[0] != '\0') {
+            glob_add(results, base, dir_only);
+        }
+        return;
+    }
+    if (strcmp(comps[0], "**") == 0) {
+        glob_recursive(base, comps + 1, num_comps - 1, dir_only, results, parallel);
+        return;
+    }
+    //Literal components need no listing
+    if (!has_glob(comps[0])) {
+        join_path(path, sizeof(path), base, comps[0]);
+        if (num_comps > 1 || dir_only || faccessat(AT_FDCWD, path, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+            glob_match(path, comps + 1, num_comps - 1, dir_only, results, parallel);
+        }
+        return;
+    }
+
+    SharedListing *shared = get_listing(base[0] != '\0' ? base : ".");
+    if (shared == NULL) {
+        return;
+    }
+    const DirListing *listing = &shared->listing;
+    int need_dir = num_comps > 1 || dir_only;
+    for (size_t off = 0; off < listing->len; ) {
+        unsigned char type = listing->data[off];
+        const char *name = listing->data + off + 1;
+        off += strlen(name) + 2;
+        if (fnmatch(comps[0], name, FNM_PERIOD) != 0 || (need_dir && !entry_is_dir(base, name, type, 1))) {
+            continue;
+        }
+        join_path(path, sizeof(path), base, name);
+        glob_match(path, comps + 1, num_comps - 1, dir_only, results, parallel);
+    }
+    release_listing(shared);
+}
+
+//Whether a word is a pattern: '*', '?' or a '[' closed by a later ']', so '[' and '[[' are not
+int has_glob(const char *word) {
+    const char *bracket = strchr(word, '[');
+    return strpbrk(word, "*?") != NULL || (bracket != NULL && strchr(bracket + 1, ']') != NULL);
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+//Expand a pattern with *, ?, [...] and ** into sorted paths appended to args, growing it as needed.
+//The paths live in the line arena like every other word. Returns the number of matches
+int expand_glob(const char *pattern, char ***args, int *count, int *capacity) {
+    char *copy = strdup(pattern);
+    char *comps[MAX_CMD_LENGTH / 2 + 2];
+    int num_comps = 0;
+    size_t len = strlen(pattern);
+    int dir_only = len > 1 && pattern[len - 1] == '/';
+    for (char *save, *comp = strtok_r(copy, "/", &save); comp != NULL; comp = strtok_r(NULL, "/", &save)) {
+        comps[num_comps++] = comp;
+    }
+    //A trailing '**' matches everything below, like '**/*'
+    if (num_comps > 0 && strcmp(comps[num_comps - 1], "**") == 0 && !dir_only) {
+        comps[num_comps++] = "*";
+    }
+
+    GlobResults results = { 0 };
+    glob_match(pattern[0] == '/' ? "/" : "", comps, num_comps, dir_only, &results, 1);
+    free(copy);
+    if (results.count == 0) {
+        return 0;
+    }
+    qsort(results.paths, results.count, sizeof(char *), compare_paths);
+    if (*count + results.count + 1 > *capacity) {
+        *capacity = (*count + results.count + 1) * 2;
+        *args = realloc(*args, *capacity * sizeof(char *));
+    }
+    //Walkers may run on the glob pool, so they collect on the heap and the arena copy is made here
+    for (int i = 0; i < results.count; i++) {
+        (*args)[(*count)++] = arena_strdup(results.paths[i]);
+        free(results.paths[i]);
+    }
+    free(results.paths);
+    return results.count;
+}
+
+//Parse a sequence body like 1..10, 01..100..5 or a..e. Returns 0 on success
+static int parse_sequence(const char *body, size_t len, BracePart *part) {
+    char text[64];
+    if (len >= sizeof(text)) {
+        return -1;
+    }
+    memcpy(text, body, len);
+    text[len] = '\0';
+    char *first = text, *last = strstr(text, "..");
+    if (last == NULL) {
+        return -1;
+    }
+    *last = '\0';
+    last += 2;
+    char *step_text = strstr(last, "..");
+    long step = 1;
+    if (step_text != NULL) {
+        *step_text = '\0';
+        step_text += 2;
+        char *end;
+        step = labs(strtol(step_text, &end, 10));
+        if (*step_text == '\0' || *end != '\0' || step == 0) {
+            return -1;
+        }
+    }
+
+    long from, to;
+    if (first[0] != '\0' && first[1] == '\0' && last[0] != '\0' && last[1] == '\0' &&
+        !(first[0] >= '0' && first[0] <= '9' && last[0] >= '0' && last[0] <= '9')) {
+        part->is_char = 1;
+        from = (unsigned char)first[0];
+        to = (unsigned char)last[0];
+    } else {
+        char *end_first, *end_last;
+        from = strtol(first, &end_first, 10);
+        to = strtol(last, &end_last, 10);
+        if (*first == '\0' || *end_first != '\0' || *last == '\0' || *end_last != '\0') {
+            return -1;
+        }
+        //A leading zero on either end pads every value to the longer width
+        const char *digits_first = first + (*first == '-'), *digits_last = last + (*last == '-');
+        if ((digits_first[0] == '0' && digits_first[1] != '\0') || (digits_last[0] == '0' && digits_last[1] != '\0')) {
+            part->width = strlen(first) > strlen(last) ? strlen(first) : strlen(last);
+        }
+    }
+    part->start = from;
+    part->step = from <= to ? step : -step;
+    part->count = labs(to - from) / step + 1;
+    return 0;
+}
+
+static void add_brace_part(BraceGen *gen, BracePart part) {
+    gen->parts = realloc(gen->parts, (gen->num_parts + 1) * sizeof(BracePart));
+    gen->parts[gen->num_parts++] = part;
+}
+
+//Parse {a,b} alternatives and {x..y[..step]} sequences in a word. Braces inside an alternative
+//get a generator of their own, read as needed. Returns NULL if the word has no brace expansion
+BraceGen *parse_braces(const char *word) {
+    BraceGen *gen = calloc(1, sizeof(BraceGen));
+    int expanded = 0;
+    const char *literal = word;
+    for (const char *c = word; *c != '\0'; c++) {
+        //'${...}' is a parameter, not a brace expansion
+        if (c[0] == '$' && c[1] == '{') {
+            int depth = 0;
+            for (c++; *c != '\0'; c++) {
+                if (*c == '{') depth++;
+                else if (*c == '}' && --depth == 0) break;
+            }
+            if (*c == '\0') {
+                break;
+            }
+            continue;
+        }
+        if (*c != '{') {
+            continue;
+        }
+        const char *close = NULL;
+        int depth = 0, commas = 0;
+        for (const char *e = c; *e != '\0'; e++) {
+            if (*e == '{') depth++;
+            else if (*e == '}' && --depth == 0) { close = e; break; }
+            else if (*e == ',' && depth == 1) commas++;
+        }
+        if (close == NULL) {
+            break;
+        }
+
+        BracePart part = { 0 };
+        if (commas > 0) {
+            //Split on top-level commas; each alternative may contain braces of its own
+            int num_words = 0;
+            part.words = malloc((commas + 1) * sizeof(char *));
+            part.nested = malloc((commas + 1) * sizeof(BraceGen *));
+            part.ends = malloc((commas + 1) * sizeof(unsigned long long));
+            const char *start = c + 1;
+            depth = 0;
+            for (const char *e = c + 1; e <= close; e++) {
+                if (*e == '{') depth++;
+                else if (*e == '}' && depth > 0) depth--;
+                else if ((*e == ',' && depth == 0) || e == close) {
+                    part.words[num_words] = strndup(start, e - start);
+                    part.nested[num_words] = parse_braces(part.words[num_words]);
+                    unsigned long long words = part.nested[num_words] != NULL ? part.nested[num_words]->total : 1;
+                    part.count = part.count > ULLONG_MAX - words ? ULLONG_MAX : part.count + words;
+                    part.ends[num_words++] = part.count;
+                    start = e + 1;
+                }
+            }
+            part.num_words = num_words;
+        } else if (parse_sequence(c + 1, close - c - 1, &part) < 0) {
+            continue;
+        }
+
+        if (c > literal) {
+            BracePart text = { .words = malloc(sizeof(char *)), .num_words = 1, .count = 1 };
+            text.words[0] = strndup(literal, c - literal);
+            add_brace_part(gen, text);
+        }
+        add_brace_part(gen, part);
+        expanded = 1;
+        literal = close + 1;
+        c = close;
+    }
+    if (!expanded) {
+        free_braces(gen);
+        return NULL;
+    }
+    if (*literal != '\0') {
+        BracePart text = { .words = malloc(sizeof(char *)), .num_words = 1, .count = 1 };
+        text.words[0] = strdup(literal);
+        add_brace_part(gen, text);
+    }
+
+    gen->index = calloc(gen->num_parts, sizeof(unsigned long long));
+    gen->total = 1;
+    for (int i = 0; i < gen->num_parts; i++) {
+        BracePart *part = &gen->parts[i];
+        size_t longest = 0;
+        if (part->words != NULL) {
+            for (int w = 0; w < part->num_words; w++) {
+                size_t len = part->nested != NULL && part->nested[w] != NULL ? part->nested[w]->max_len : strlen(part->words[w]);
+                longest = len > longest ? len : longest;
+            }
+        } else {
+            longest = part->is_char ? 1 : 21;
+            longest = (size_t)part->width > longest ? (size_t)part->width : longest;
+        }
+        gen->max_len += longest;
+        gen->total = gen->total > ULLONG_MAX / part->count ? ULLONG_MAX : gen->total * part->count;
+    }
+    return gen;
+}
+
+static size_t write_brace_word(BraceGen *gen, char *out, size_t size);
+
+//Write value k of a part to out. Returns the length written, truncated to fit size
+static size_t write_brace_part(const BracePart *part, unsigned long long k, char *out, size_t size) {
+    int n;
+    if (part->words == NULL) {
+        long value = part->start + (long)k * part->step;
+        n = part->is_char ? snprintf(out, size, "%c", (char)value) : snprintf(out, size, "%0*ld", part->width, value);
+    } else if (part->ends == NULL) {
+        n = snprintf(out, size, "%s", part->words[k]);
+    } else {
+        //Find the alternative holding value k; one with braces of its own yields several
+        int w = 0;
+        while (part->ends[w] <= k) w++;
+        if (part->nested[w] == NULL) {
+            n = snprintf(out, size, "%s", part->words[w]);
+        } else {
+            BraceGen *nested = part->nested[w];
+            k -= w > 0 ? part->ends[w - 1] : 0;
+            for (int i = nested->num_parts - 1; i >= 0; i--) {
+                nested->index[i] = k % nested->parts[i].count;
+                k /= nested->parts[i].count;
+            }
+            return write_brace_word(nested, out, size);
+        }
+    }
+    return n < (int)size ? (size_t)n : size - 1;
+}
+
+//Write the word at the odometer's position to out
+static size_t write_brace_word(BraceGen *gen, char *out, size_t size) {
+    size_t len = 0;
+    out[0] = '\0';
+    for (int i = 0; i < gen->num_parts && len < size - 1; i++) {
+        len += write_brace_part(&gen->parts[i], gen->index[i], out + len, size - len);
+    }
+    return len;
+}
+
+//Write the next word of the expansion to out. Returns its length, or -1 when all were produced
+int next_brace_word(BraceGen *gen, char *out, size_t size) {
+    if (gen->produced >= gen->total) {
+        return -1;
+    }
+    size_t len = write_brace_word(gen, out, size);
+    for (int i = gen->num_parts - 1; i >= 0; i--) {
+        if (++gen->index[i] < gen->parts[i].count) {
+            break;
+        }
+        gen->index[i] = 0;
+    }
+    gen->produced++;
+    return len;
+}
+
+void free_braces(BraceGen *gen) {
+    for (int i = 0; i < gen->num_parts; i++) {
+        BracePart *part = &gen->parts[i];
+        for (int w = 0; part->words != NULL && w < part->num_words; w++) {
+            free(part->words[w]);
+            if (part->nested != NULL && part->nested[w] != NULL) {
+                free_braces(part->nested[w]);
+            }
+        }
+        free(part->words);
+        free(part->nested);
+        free(part->ends);
+    }
+    free(gen->parts);
+    free(gen->index);
+    free(gen);
+}
+
+//Prepare a batcher for prefix WORDS... tail under the kernel's argument limit, counting
+//the environment and the fixed arguments. Returns 0 on success
+int batch_init(Batcher *batch, char **prefix, int num_prefix, char **tail, int num_tail, int parallel) {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    size_t fixed = 0;
+    for (char **env = current_envp(); *env != NULL; env++) {
+        fixed += strlen(*env) + 1 + sizeof(char *);
+    }
+    for (int i = 0; i < num_prefix; i++) {
+        fixed += strlen(prefix[i]) + 1 + sizeof(char *);
+    }
+    for (int i = 0; i < num_tail; i++) {
+        fixed += strlen(tail[i]) + 1 + sizeof(char *);
+    }
+    //Leave headroom like xargs does for the auxiliary vector and the terminating pointers
+    fixed += 2048 + sizeof(char *);
+    if (arg_max <= 0 || (size_t)arg_max <= fixed) {
+        fprintf(stderr, "Error: Argument list too long\n");
+        return -1;
+    }
+
+    *batch = (Batcher) { .num_prefix = num_prefix, .tail = tail, .num_tail = num_tail, .parallel = parallel > 0 ? parallel : 1, .cmd = child_cmd };
+    batch->limit = arg_max - fixed;
+    batch->max_words = batch->limit / (1 + sizeof(char *)) + 1;
+    batch->argv = malloc((num_prefix + batch->max_words + num_tail + 1) * sizeof(char *));
+    batch->arena = malloc(batch->limit);
+    batch->pids = malloc(batch->parallel * sizeof(pid_t));
+    batch->pidfds = malloc(batch->parallel * sizeof(int));
+    memcpy(batch->argv, prefix, num_prefix * sizeof(char *));
+    return 0;
+}
+
+//Wait for one running batch and fold its status in: 123 if a command failed,
+//125 if one was killed, 126/127 if it could not be run. Only the batcher's own children
+//are waited for, so it can run inside the shell next to background jobs
+static void batch_wait(Batcher *batch) {
+    int done = 0;
+    if (batch->running > 1 && batch->pidfds[0] >= 0) {
+        struct pollfd fds[batch->running];
+        for (int i = 0; i < batch->running; i++) {
+            fds[i] = (struct pollfd) { .fd = batch->pidfds[i], .events = POLLIN };
+        }
+        while (poll(fds, batch->running, -1) < 0 && errno == EINTR);
+        while (done < batch->running - 1 && !(fds[done].revents & POLLIN)) done++;
+    }
+    int status;
+    while (waitpid(batch->pids[done], &status, 0) < 0 && errno == EINTR);
+    if (batch->pidfds[done] >= 0) {
+        close(batch->pidfds[done]);
+    }
+    batch->running--;
+    batch->pids[done] = batch->pids[batch->running];
+    batch->pidfds[done] = batch->pidfds[batch->running];
+
+    if (WIFSIGNALED(status)) {
+        batch->status = 125;
+    } else if (WEXITSTATUS(status) == 126 || WEXITSTATUS(status) == 127) {
+        batch->status = WEXITSTATUS(status);
+    } else if (WEXITSTATUS(status) != 0 && batch->status == 0) {
+        batch->status = 123;
+    }
+}
+
+//Run the current batch, waiting first if the parallel limit is reached. Batches are started
+//from a job's child, so they are already in its cgroup and counted by its inherited counters
+static void batch_flush(Batcher *batch) {
+    if (batch->exec_failed) {
+        batch->count = 0;
+        batch->used = 0;
+        return;
+    }
+    if (batch->running >= batch->parallel) {
+        batch_wait(batch);
+    }
+    char **argv = batch->argv;
+    if (batch->num_tail > 0) {
+        memcpy(argv + batch->num_prefix + batch->count, batch->tail, batch->num_tail * sizeof(char *));
+    }
+    argv[batch->num_prefix + batch->count + batch->num_tail] = NULL;
+
+    //The child writes its exec errno here; a successful exec closes it with nothing written
+    int exec_pipe[2];
+    if (pipe2(exec_pipe, O_CLOEXEC) < 0) {
+        exec_pipe[0] = exec_pipe[1] = -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        //xargs blocks SIGCHLD while it waits; batches start with the default disposition
+        signal(SIGCHLD, SIG_DFL);
+        setup_child(batch->cmd);
+        if (exec_pipe[0] >= 0) {
+            close(exec_pipe[0]);
+        }
+
+        const Builtin *builtin = find_builtin(argv[0]);
+        if (builtin != NULL) {
+            int status = builtin->fn(argv);
+            fflush(stdout);
+            _exit(status);
+        }
+        execvpe(argv[0], argv, current_envp());
+        int exec_errno = errno;
+        if (exec_pipe[1] < 0 || write(exec_pipe[1], &exec_errno, sizeof(exec_errno)) != sizeof(exec_errno)) {
+            fprintf(stderr, "Error: %s: %s\n", argv[0], strerror(exec_errno));
+        }
+        _exit(exec_errno == ENOENT ? 127 : 126);
+    } else if (pid < 0) {
+        perror("fork failed");
+        batch->status = 125;
+        if (exec_pipe[0] >= 0) {
+            close(exec_pipe[0]);
+            close(exec_pipe[1]);
+        }
+    } else {
+        batch->pids[batch->running] = pid;
+        batch->pidfds[batch->running] = batch->parallel > 1 ? syscall(SYS_pidfd_open, pid, 0) : -1;
+        batch->running++;
+        //Like GNU xargs, a command that cannot be run stops the remaining batches
+        if (exec_pipe[0] >= 0) {
+            close(exec_pipe[1]);
+            batch->exec_failed = report_exec_status(exec_pipe[0], argv[0]);
+        }
+    }
+    //The child has its own copy of the words, so the arena is free again
+    batch->count = 0;
+    batch->used = 0;
+}
+
+//Add a word to the current batch, running the batch first if the word does not fit
+void batch_add(Batcher *batch, const char *word) {
+    size_t len = strlen(word) + 1;
+    if (len + sizeof(char *) > batch->limit) {
+        fprintf(stderr, "Error: Argument too long: %.32s...\n", word);
+        batch->status = 123;
+        return;
+    }
+    if (batch->used + len + sizeof(char *) > batch->limit || (batch->max_count > 0 && batch->count == batch->max_count)) {
+        batch_flush(batch);
+    }
+    char *copy = batch->arena + batch->used;
+    memcpy(copy, word, len);
+    batch->used += len + sizeof(char *);
+    batch->argv[batch->num_prefix + batch->count++] = copy;
+}
+
+//Run the last batch and wait for all of them. Returns the combined status
+int batch_finish(Batcher *batch) {
+    if (batch->count > 0) {
+        batch_flush(batch);
+    }
+    while (batch->running > 0) {
+        batch_wait(batch);
+    }
+    free(batch->argv);
+    free(batch->arena);
+    free(batch->pids);
+    free(batch->pidfds);
+    return batch->status;
+}
+
+//Run a command on the words read from standard input, packed into as few invocations as fit
+//under ARG_MAX: 'xargs [-0] [-r] [-n MAX] [-P JOBS] [command [args...]]', echo by default
+int builtin_xargs(char **args) {
+    int null_separated = 0, skip_empty = 0, max_count = 0, parallel = 1, i = 1;
+    for (; args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-0") == 0) {
+            null_separated = 1;
+        } else if (strcmp(args[i], "-r") == 0) {
+            skip_empty = 1;
+        } else if ((args[i][1] == 'n' || args[i][1] == 'P') && (args[i][2] != '\0' || args[i + 1] != NULL)) {
+            //The count may be attached, as in -P4
+            int *option = args[i][1] == 'n' ? &max_count : &parallel;
+            *option = atoi(args[i][2] != '\0' ? args[i] + 2 : args[++i]);
+            if (*option <= 0) {
+                fprintf(stderr, "Error: xargs: Invalid count: %s\n", args[i]);
+                return 1;
+            }
+        } else if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else {
+            fprintf(stderr, "Error: Usage: xargs [-0] [-r] [-n MAX] [-P JOBS] [command [args...]]\n");
+            return 1;
+        }
+    }
+    char *echo[] = { "echo", NULL };
+    char **command = args[i] != NULL ? args + i : echo;
+    int num_command = 0;
+    while (command[num_command] != NULL) num_command++;
+
+    //The batches are our children; keep the shell's SIGCHLD handler from reaping them
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old_mask);
+
+    Batcher batch;
+    if (batch_init(&batch, command, num_command, NULL, 0, parallel) < 0) {
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        return 1;
+    }
+    batch.max_count = max_count;
+
+    //Without -0, words are split on blanks and newlines, and like GNU xargs, single or double
+    //quotes keep blanks in a word (without crossing a line) and a backslash escapes any character
+    char buf[65536];
+    size_t word_capacity = 256, word_len = 0;
+    char *word = malloc(word_capacity);
+    int words = 0, in_word = 0, escaped = 0, unmatched = 0;
+    char quote = '\0';
+    ssize_t n;
+    while (!unmatched && (n = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: xargs: read: %s\n", strerror(errno));
+            break;
+        }
+        for (ssize_t j = 0; j < n && !unmatched; j++) {
+            char c = buf[j];
+            int separator;
+            if (null_separated) {
+                separator = c == '\0';
+            } else if (escaped) {
+                separator = escaped = 0;
+            } else if (quote != '\0' && c == '\n') {
+                unmatched = 1;
+                break;
+            } else if (quote != '\0' && c == quote) {
+                quote = '\0';
+                continue;
+            } else if (quote != '\0') {
+                separator = 0;
+            } else if (c == '\\') {
+                in_word = escaped = 1;
+                continue;
+            } else if (c == '\'' || c == '"') {
+                //A quote starts a word, so '' is an empty argument
+                in_word = 1;
+                quote = c;
+                continue;
+            } else {
+                separator = c == ' ' || c == '\t' || c == '\n';
+            }
+            if (!separator) {
+                if (word_len + 1 >= word_capacity) {
+                    word_capacity *= 2;
+                    word = realloc(word, word_capacity);
+                }
+                word[word_len++] = c;
+                in_word = 1;
+            } else if (in_word) {
+                word[word_len] = '\0';
+                batch_add(&batch, word);
+                word_len = 0;
+                in_word = 0;
+                words++;
+            }
+        }
+    }
+    if (unmatched || quote != '\0') {
+        //Nothing more runs, like GNU xargs; batches already started are still waited for
+        fprintf(stderr, "Error: xargs: Unmatched %s quote\n", quote == '\'' ? "single" : "double");
+        batch.count = 0;
+        batch_finish(&batch);
+        fflush(stdout);
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        free(word);
+        return 1;
+    }
+    if (in_word) {
+        word[word_len] = '\0';
+        batch_add(&batch, word);
+        words++;
+    }
+    free(word);
+    //Like GNU xargs, the command runs once even without input unless -r is given
+    if (words == 0 && !skip_empty) {
+        batch_flush(&batch);
+    }
+    int status = batch_finish(&batch);
+    fflush(stdout);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return status;
+}
+
+//FNV-1a hash of a variable name
+static uint32_t hash_name(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+//Slot of the variable name[0..len), or of where it would go. Removed variables leave a
+//tombstone (name set, value NULL) so probing continues past them
+static Variable *find_variable(const char *name, size_t len, uint32_t hash) {
+    size_t mask = variables_capacity - 1;
+    Variable *tombstone = NULL;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        Variable *var = &variables[i];
+        if (var->name == NULL) {
+            return tombstone != NULL ? tombstone : var;
+        }
+        if (var->value == NULL) {
+            if (tombstone == NULL) tombstone = var;
+        } else if (var->hash == hash && strncmp(var->name, name, len) == 0 && var->name[len] == '\0') {
+            return var;
+        }
+    }
+}
+
+//Double the table when it is 70% full, dropping tombstones
+static void grow_variables() {
+    Variable *old = variables;
+    size_t old_capacity = variables_capacity;
+    variables_capacity = old_capacity ? old_capacity * 2 : 256;
+    variables = calloc(variables_capacity, sizeof(Variable));
+    variables_used = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].value != NULL) {
+            *find_variable(old[i].name, strlen(old[i].name), old[i].hash) = old[i];
+            variables_used++;
+        } else {
+            free(old[i].name);
+        }
+    }
+    free(old);
+}
+
+//Canonical copy of a short value from the intern pool, or NULL if it is long or the pool is full
+static const char *intern_value(const char *value) {
+    size_t len = strlen(value);
+    if (len > INTERN_MAX_LEN) {
+        return NULL;
+    }
+    uint32_t hash = hash_name(value, len);
+    for (int probe = 0; probe < INTERN_CAPACITY; probe++) {
+        const char **slot = &intern_pool[(hash + probe) & (INTERN_CAPACITY - 1)];
+        if (*slot == NULL) {
+            //Keep a quarter of the pool free so probes stay short
+            if (intern_count * 4 >= INTERN_CAPACITY * 3) {
+                return NULL;
+            }
+            intern_count++;
+            *slot = strdup(value);
+            return *slot;
+        }
+        if (strcmp(*slot, value) == 0) {
+            return *slot;
+        }
+    }
+    return NULL;
+}
+
+//Import the inherited environment as exported variables
+void init_variables() {
+    extern char **environ;
+    grow_variables();
+    for (char **env = environ; *env != NULL; env++) {
+        char *equals = strchr(*env, '=');
+        if (equals != NULL) {
+            *equals = '\0';
+            set_variable(*env, equals + 1, 1);
+            *equals = '=';
+        }
+    }
+    //The inherited environment is still current until a change
+    cached_envp = environ;
+    envp_dirty = 0;
+}
+
+//Value of a variable, NULL if it is not set
+const char *get_variable(const char *name) {
+    Variable *var = find_variable(name, strlen(name), hash_name(name, strlen(name)));
+    return var->name != NULL ? var->value : NULL;
+}
+
+//Set a variable; export marks it exported, and an exported variable stays exported
+void set_variable(const char *name, const char *value, int export) {
+    size_t len = strlen(name);
+    uint32_t hash = hash_name(name, len);
+    Variable *var = find_variable(name, len, hash);
+    //value may be the variable's own value
+    const char *pooled = intern_value(value);
+    char *copy = pooled != NULL ? (char *)pooled : strdup(value);
+    if (var->name == NULL || var->value == NULL) {
+        if (var->name == NULL && (variables_used + 1) * 10 > variables_capacity * 7) {
+            grow_variables();
+            var = find_variable(name, len, hash);
+        }
+        if (var->name == NULL) {
+            variables_used++;
+        }
+        free(var->name);
+        *var = (Variable) { .name = strdup(name), .hash = hash };
+    } else if (!var->interned) {
+        free(var->value);
+    }
+    var->value = copy;
+    var->interned = pooled != NULL;
+    var->exported |= export;
+    envp_dirty |= var->exported;
+}
+
+void unset_variable(const char *name) {
+    Variable *var = find_variable(name, strlen(name), hash_name(name, strlen(name)));
+    if (var->name != NULL && var->value != NULL) {
+        envp_dirty |= var->exported;
+        if (!var->interned) {
+            free(var->value);
+        }
+        var->value = NULL;
+        var->exported = 0;
+    }
+}
+
+//The environment for spawned commands, rebuilt into one allocation if exported variables changed
+char **current_envp() {
+    extern char **environ;
+    static char **owned = NULL;
+    if (!envp_dirty) {
+        return cached_envp;
+    }
+    size_t count = 0, bytes = 0;
+    for (size_t i = 0; i < variables_capacity; i++) {
+        Variable *var = &variables[i];
+        if (var->value != NULL && var->exported) {
+            count++;
+            bytes += strlen(var->name) + strlen(var->value) + 2;
+        }
+    }
+    char **envp = malloc((count + 1) * sizeof(char *) + bytes);
+    char *strings = (char *)(envp + count + 1);
+    count = 0;
+    for (size_t i = 0; i < variables_capacity; i++) {
+        Variable *var = &variables[i];
+        if (var->value != NULL && var->exported) {
+            envp[count++] = strings;
+            strings += sprintf(strings, "%s=%s", var->name, var->value) + 1;
+        }
+    }
+    envp[count] = NULL;
+
+    //getenv in the shell sees the same variables as its commands
+    environ = envp;
+    cached_envp = envp;
+    free(owned);
+    owned = envp;
+    envp_dirty = 0;
+    return envp;
+}
+
+//Length of the variable name at the start of word, 0 if it does not start with one
+static size_t name_length(const char *word) {
+    if (!(word[0] == '_' || (word[0] >= 'a' && word[0] <= 'z') || (word[0] >= 'A' && word[0] <= 'Z'))) {
+        return 0;
+    }
+    size_t len = 1;
+    while (word[len] == '_' || (word[len] >= 'a' && word[len] <= 'z') || (word[len] >= 'A' && word[len] <= 'Z') ||
+           (word[len] >= '0' && word[len] <= '9')) {
+        len++;
+    }
+    return len;
+}
+
+//Whether a word is NAME=value with a valid name
+int is_assignment(const char *word) {
+    size_t len = name_length(word);
+    return len > 0 && word[len] == '=';
+}
+
+static int compare_variables(const void *a, const void *b) {
+    return strcmp((*(Variable *const *)a)->name, (*(Variable *const *)b)->name);
+}
+
+//Export variables: 'export NAME[=value]...', or list the exported ones without arguments
+int builtin_export(char **args) {
+    if (args[1] == NULL) {
+        Variable **sorted = malloc(variables_capacity * sizeof(Variable *));
+        size_t count = 0;
+        for (size_t i = 0; i < variables_capacity; i++) {
+            if (variables[i].value != NULL && variables[i].exported) {
+                sorted[count++] = &variables[i];
+            }
+        }
+        qsort(sorted, count, sizeof(Variable *), compare_variables);
+        for (size_t i = 0; i < count; i++) {
+            printf("export %s=%s\n", sorted[i]->name, sorted[i]->value);
+        }
+        free(sorted);
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        char *equals = strchr(args[i], '=');
+        if (equals != NULL && is_assignment(args[i])) {
+            *equals = '\0';
+            set_variable(args[i], equals + 1, 1);
+            *equals = '=';
+        } else if (equals == NULL && name_length(args[i]) == strlen(args[i])) {
+            //An unset name is exported with an empty value
+            const char *value = get_variable(args[i]);
+            set_variable(args[i], value != NULL ? value : "", 1);
+        } else {
+            fprintf(stderr, "Error: export: Invalid name: %s\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+int builtin_unset(char **args) {
+    for (int i = 1; args[i] != NULL; i++) {
+        unset_variable(args[i]);
+    }
+    return 0;
+}
+
+//Start a new line: rewind to the first chunk
+void arena_reset() {
+    line_arena.current = 0;
+    line_arena.used = 0;
+}
+
+//Make room for at least size bytes at the end of the arena, moving to a new chunk if needed
+static char *arena_reserve(size_t size) {
+    LineArena *arena = &line_arena;
+    while (arena->num_chunks == 0 || arena->used + size > arena->sizes[arena->current]) {
+        if (arena->num_chunks > 0 && arena->current + 1 < arena->num_chunks) {
+            arena->current++;
+            arena->used = 0;
+            continue;
+        }
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        arena->chunks = realloc(arena->chunks, (arena->num_chunks + 1) * sizeof(char *));
+        arena->sizes = realloc(arena->sizes, (arena->num_chunks + 1) * sizeof(size_t));
+        arena->chunks[arena->num_chunks] = malloc(chunk_size);
+        arena->sizes[arena->num_chunks] = chunk_size;
+        if (arena->num_chunks > 0) {
+            arena->current++;
+        }
+        arena->num_chunks++;
+        arena->used = 0;
+    }
+    return arena->chunks[arena->current] + arena->used;
+}
+
+char *arena_strdup(const char *text) {
+    size_t len = strlen(text) + 1;
+    char *copy = arena_reserve(len);
+    memcpy(copy, text, len);
+    line_arena.used += len;
+    return copy;
+}
+
+//Append to an expansion. A word outgrowing its chunk moves to a new one; a fixed buffer truncates
+static void expand_put(ExpandOut *out, const char *data, size_t len) {
+    if (out->len + len + 1 > out->capacity) {
+        if (!out->in_arena) {
+            len = out->capacity - 1 - out->len;
+        } else {
+            char *moved = arena_reserve((out->len + len + 1) * 2);
+            memcpy(moved, out->buf, out->len);
+            out->buf = moved;
+            out->capacity = line_arena.sizes[line_arena.current] - line_arena.used;
+        }
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+//Value of a parameter: a variable or one of $?, $$, $!, $0. special holds numbers
+static const char *parameter_value(const char *name, size_t len, char *special, size_t size) {
+    if (len == 1 && (name[0] == '?' || name[0] == '$' || name[0] == '!' || name[0] == '0')) {
+        if (name[0] == '0') return "mysh";
+        if (name[0] == '!' && last_background_pid == 0) return NULL;
+        snprintf(special, size, "%d", name[0] == '?' ? last_status : name[0] == '$' ? (int)getpid() : (int)last_background_pid);
+        return special;
+    }
+    char key[MAX_CMD_LENGTH];
+    if (len >= sizeof(key)) {
+        return NULL;
+    }
+    memcpy(key, name, len);
+    key[len] = '\0';
+    return get_variable(key);
+}
+
+//Length of the parameter name at text: a variable name or one special character
+static size_t parameter_length(const char *text) {
+    size_t len = name_length(text);
+    if (len == 0 && (text[0] == '?' || text[0] == '$' || text[0] == '!' || text[0] == '0')) {
+        len = 1;
+    }
+    return len;
+}
+
+static void expand_range(ExpandOut *out, const char *text, const char *end);
+
+//Expand the body of ${...} between text and end
+static void expand_braced(ExpandOut *out, const char *text, const char *end) {
+    char special[32], value_buf[MAX_CMD_LENGTH];
+    if (text[0] == '#' && parameter_length(text + 1) == (size_t)(end - text - 1)) {
+        //${#NAME}: length of the value
+        const char *value = parameter_value(text + 1, end - text - 1, special, sizeof(special));
+        int n = snprintf(special, sizeof(special), "%zu", value != NULL ? strlen(value) : 0);
+        expand_put(out, special, n);
+        return;
+    }
+    size_t name_len = parameter_length(text);
+    const char *op = text + name_len;
+    const char *value = name_len > 0 ? parameter_value(text, name_len, special, sizeof(special)) : NULL;
+    if (name_len == 0 || (op != end && strchr(":-=+#%", *op) == NULL)) {
+        fprintf(stderr, "Error: Bad substitution: ${%.*s}\n", (int)(end - text), text);
+        return;
+    }
+    if (op == end) {
+        if (value != NULL) expand_put(out, value, strlen(value));
+        return;
+    }
+
+    //${NAME:-word} ${NAME:=word} ${NAME:+word}, and without ':' testing only for unset
+    int colon = *op == ':';
+    if (colon || *op == '-' || *op == '=' || *op == '+') {
+        char kind = op[colon];
+        const char *arg = op + colon + 1;
+        int set = value != NULL && (!colon || value[0] != '\0');
+        if (kind == '+') {
+            if (set) expand_range(out, arg, end);
+        } else if (set) {
+            expand_put(out, value, strlen(value));
+        } else if (kind == '-' || kind == '=') {
+            size_t start = out->len;
+            expand_range(out, arg, end);
+            if (kind == '=' && name_length(text) == name_len) {
+                char name[MAX_CMD_LENGTH], assigned[MAX_CMD_LENGTH];
+                snprintf(name, sizeof(name), "%.*s", (int)name_len, text);
+                snprintf(assigned, sizeof(assigned), "%.*s", (int)(out->len - start), out->buf + start);
+                set_variable(name, assigned, 0);
+            }
+        } else {
+            fprintf(stderr, "Error: Bad substitution: ${%.*s}\n", (int)(end - text), text);
+        }
+        return;
+    }
+
+    //${NAME#pattern} ${NAME##pattern} ${NAME%pattern} ${NAME%%pattern}
+    int longest = op[1] == op[0];
+    char pattern[MAX_CMD_LENGTH];
+    ExpandOut pattern_out = { .buf = pattern, .capacity = sizeof(pattern) };
+    expand_range(&pattern_out, op + 1 + longest, end);
+    pattern[pattern_out.len] = '\0';
+    if (value == NULL) {
+        return;
+    }
+    size_t len = strlen(value);
+    if (len >= sizeof(value_buf)) {
+        expand_put(out, value, len);
+        return;
+    }
+    memcpy(value_buf, value, len + 1);
+    size_t keep_from = 0, keep_to = len;
+    if (op[0] == '#') {
+        for (size_t i = 0; i <= len; i++) {
+            size_t cut = longest ? len - i : i;
+            char saved = value_buf[cut];
+            value_buf[cut] = '\0';
+            int match = fnmatch(pattern, value_buf, 0) == 0;
+            value_buf[cut] = saved;
+            if (match) {
+                keep_from = cut;
+                break;
+            }
+        }
+    } else {
+        for (size_t i = 0; i <= len; i++) {
+            size_t cut = longest ? i : len - i;
+            if (fnmatch(pattern, value_buf + cut, 0) == 0) {
+                keep_to = cut;
+                break;
+            }
+        }
+    }
+    expand_put(out, value_buf + keep_from, keep_to - keep_from);
+}
+
+//Expand parameters in text up to end, in one left-to-right pass
+static void expand_range(ExpandOut *out, const char *text, const char *end) {
+    char special[32];
+    const char *literal = text;
+    for (const char *c = text; c < end; c++) {
+        if (*c != '$' || c + 1 >= end) {
+            continue;
+        }
+        expand_put(out, literal, c - literal);
+        if (c[1] == '(' && c + 2 < end && c[2] == '(') {
+            //$(( expression )): find the '))' closing it
+            const char *close = c + 3;
+            for (int depth = 0; close + 1 < end; close++) {
+                if (*close == '(') depth++;
+                else if (*close == ')' && depth > 0) depth--;
+                else if (*close == ')' && close[1] == ')') break;
+            }
+            if (close + 1 >= end) {
+                literal = c;
+                break;
+            }
+            char expression[MAX_CMD_LENGTH];
+            long long result;
+            snprintf(expression, sizeof(expression), "%.*s", (int)(close - c - 3), c + 3);
+            if (evaluate_arithmetic(expression, &result) == 0) {
+                int n = snprintf(special, sizeof(special), "%lld", result);
+                expand_put(out, special, n);
+            } else {
+                expansion_failed = 1;
+            }
+            c = close + 1;
+        } else if (c[1] == '{') {
+            //Find the matching brace, allowing nested ${...} in the word
+            const char *close = c + 2;
+            for (int depth = 1; close < end; close++) {
+                if (*close == '{') depth++;
+                else if (*close == '}' && --depth == 0) break;
+            }
+            if (close >= end) {
+                literal = c;
+                break;
+            }
+            expand_braced(out, c + 2, close);
+            c = close;
+        } else {
+            size_t name_len = parameter_length(c + 1);
+            if (name_len == 0) {
+                //A '$' not followed by a name stays as written
+                literal = c;
+                continue;
+            }
+            const char *value = parameter_value(c + 1, name_len, special, sizeof(special));
+            if (value != NULL) {
+                expand_put(out, value, strlen(value));
+            }
+            c += name_len;
+        }
+        literal = c + 1;
+    }
+    expand_put(out, literal, end - literal);
+}
+
+//Expand $NAME, ${NAME}, ${NAME:-word}, ${NAME:=word}, ${NAME:+word}, ${NAME#pattern},
+//${NAME%pattern} (and ## %%), ${#NAME}, $?, $$, $! and $0 in a word. The result is written
+//straight into the line arena; a word that is only an interned $NAME is the value itself
+const char *expand_word(const char *word) {
+    if (strchr(word, '$') == NULL) {
+        return arena_strdup(word);
+    }
+    size_t name_len = parameter_length(word + 1);
+    if (word[0] == '$' && name_len == name_length(word + 1) && name_len > 0 && word[1 + name_len] == '\0') {
+        Variable *var = find_variable(word + 1, name_len, hash_name(word + 1, name_len));
+        if (var->name != NULL && var->value != NULL && var->interned) {
+            return var->value;
+        }
+    }
+
+    size_t len = strlen(word);
+    ExpandOut out = { .buf = arena_reserve(len + 1), .in_arena = 1 };
+    out.capacity = line_arena.sizes[line_arena.current] - line_arena.used;
+    expand_range(&out, word, word + len);
+    out.buf[out.len] = '\0';
+    line_arena.used = out.buf + out.len + 1 - line_arena.chunks[line_arena.current];
+    return out.buf;
+}
+
+//Deep copy of a parsed line, for jobs that outlive the line arena
+CmdSet copy_cmdset(const CmdSet *cmdset) {
+    CmdSet copy = *cmdset;
+    for (int i = 0; i < cmdset->num_commands; i++) {
+        Cmd *cmd = &copy.commands[i];
+        int count = 0;
+        while (cmd->args[count] != NULL) count++;
+        cmd->args = malloc((count + 1) * sizeof(char *));
+        for (int a = 0; a <= count; a++) {
+            cmd->args[a] = cmdset->commands[i].args[a] != NULL ? strdup(cmdset->commands[i].args[a]) : NULL;
+        }
+        cmd->input_file = cmd->input_file != NULL ? strdup(cmd->input_file) : NULL;
+        cmd->output_file = cmd->output_file != NULL ? strdup(cmd->output_file) : NULL;
+        cmd->read_stream = cmd->read_stream != NULL ? strdup(cmd->read_stream) : NULL;
+        cmd->write_stream = cmd->write_stream != NULL ? strdup(cmd->write_stream) : NULL;
+        if (cmd->assignments != NULL) {
+            count = 0;
+            while (cmd->assignments[count] != NULL) count++;
+            cmd->assignments = malloc((count + 1) * sizeof(char *));
+            for (int a = 0; a <= count; a++) {
+                cmd->assignments[a] = cmdset->commands[i].assignments[a] != NULL ? strdup(cmdset->commands[i].assignments[a]) : NULL;
+            }
+        }
+    }
+    return copy;
+}
+
+//Free a line copied by copy_cmdset once it has been started
+void free_cmdset(CmdSet *cmdset) {
+    for (int i = 0; i < cmdset->num_commands; i++) {
+        Cmd *cmd = &cmdset->commands[i];
+        for (int a = 0; cmd->args[a] != NULL; a++) {
+            free(cmd->args[a]);
+        }
+        free(cmd->args);
+        free(cmd->input_file);
+        free(cmd->output_file);
+        free(cmd->read_stream);
+        free(cmd->write_stream);
+        for (int a = 0; cmd->assignments != NULL && cmd->assignments[a] != NULL; a++) {
+            free(cmd->assignments[a]);
+        }
+        free(cmd->assignments);
+    }
+    cmdset->num_commands = 0;
+}
+
+//The tokenizer splits '$(( i + 1 ))' at blanks; glue such pieces back into one word. Returns
+//the line's words in the arena, pointing into tokens, which the tokenizer still owns
+char **join_arithmetic_tokens(char **tokens) {
+    int count = 0;
+    while (tokens[count] != NULL) count++;
+    //The word array holds pointers, so it starts at an aligned offset
+    line_arena.used = (line_arena.used + sizeof(char *) - 1) & ~(sizeof(char *) - 1);
+    char **words = (char **)arena_reserve((count + 1) * sizeof(char *));
+    line_arena.used += (count + 1) * sizeof(char *);
+
+    int num_words = 0;
+    for (int i = 0; tokens[i] != NULL; i++) {
+        words[num_words++] = tokens[i];
+        if (strstr(tokens[i], "$((") == NULL) {
+            continue;
+        }
+        int balance = 0, last = i;
+        for (int j = i; tokens[j] != NULL; j++) {
+            for (const char *c = tokens[j]; *c != '\0'; c++) {
+                balance += *c == '(' ? 1 : *c == ')' ? -1 : 0;
+            }
+            last = j;
+            if (balance <= 0) {
+                break;
+            }
+        }
+        if (last == i) {
+            continue;
+        }
+        size_t len = 0;
+        for (int j = i; j <= last; j++) {
+            len += strlen(tokens[j]) + 1;
+        }
+        char *joined = arena_reserve(len);
+        line_arena.used += len;
+        len = 0;
+        for (int j = i; j <= last; j++) {
+            len += sprintf(joined + len, j > i ? " %s" : "%s", tokens[j]);
+        }
+        words[num_words - 1] = joined;
+        i = last;
+    }
+    words[num_words] = NULL;
+    return words;
+}
+
+//Arithmetic instructions. Binary operators pop two values and push one
+enum {
+    ARITH_PUSH, ARITH_LOAD, ARITH_STORE, ARITH_POP, ARITH_DUP, ARITH_JZ, ARITH_JNZ, ARITH_JMP, ARITH_BOOL,
+    ARITH_NEG, ARITH_NOT, ARITH_BITNOT,
+    ARITH_MUL, ARITH_DIV, ARITH_MOD, ARITH_ADD, ARITH_SUB, ARITH_SHL, ARITH_SHR,
+    ARITH_LT, ARITH_LE, ARITH_GT, ARITH_GE, ARITH_EQ, ARITH_NE, ARITH_AND, ARITH_XOR, ARITH_OR,
+};
+
+//Binary operators by spelling, longest first, with precedence (higher binds tighter)
+static const struct { const char *text; int op; int prec; } arith_binary[] = {
+    { "<<", ARITH_SHL, 11 }, { ">>", ARITH_SHR, 11 }, { "<=", ARITH_LE, 10 }, { ">=", ARITH_GE, 10 },
+    { "==", ARITH_EQ, 9 }, { "!=", ARITH_NE, 9 }, { "&&", -1, 5 }, { "||", -2, 4 },
+    { "*", ARITH_MUL, 13 }, { "/", ARITH_DIV, 13 }, { "%", ARITH_MOD, 13 }, { "+", ARITH_ADD, 12 },
+    { "-", ARITH_SUB, 12 }, { "<", ARITH_LT, 10 }, { ">", ARITH_GT, 10 }, { "&", ARITH_AND, 8 },
+    { "^", ARITH_XOR, 7 }, { "|", ARITH_OR, 6 }, { "?", -3, 3 },
+};
+
+//Assignment operators and the binary operator they apply
+static const struct { const char *text; int op; } arith_assign[] = {
+    { "<<=", ARITH_SHL }, { ">>=", ARITH_SHR }, { "+=", ARITH_ADD }, { "-=", ARITH_SUB }, { "*=", ARITH_MUL },
+    { "/=", ARITH_DIV }, { "%=", ARITH_MOD }, { "&=", ARITH_AND }, { "^=", ARITH_XOR }, { "|=", ARITH_OR },
+    { "=", -1 },
+};
+
+typedef struct {
+    const char *pos;
+    ArithProgram *program;
+    int capacity;
+    const char *error;
+} ArithCompiler;
+
+static int arith_emit(ArithCompiler *compiler, int op, long long value) {
+    ArithProgram *program = compiler->program;
+    if (program->length == compiler->capacity) {
+        compiler->capacity = compiler->capacity ? compiler->capacity * 2 : 32;
+        program->code = realloc(program->code, compiler->capacity * sizeof(ArithInsn));
+    }
+    program->code[program->length] = (ArithInsn) { .op = op, .value = value };
+    return program->length++;
+}
+
+static void arith_skip_blanks(ArithCompiler *compiler) {
+    while (*compiler->pos == ' ' || *compiler->pos == '\t' || *compiler->pos == '\n') compiler->pos++;
+}
+
+//Match an operator at the current position without consuming it
+static int arith_at(ArithCompiler *compiler, const char *text) {
+    arith_skip_blanks(compiler);
+    return strncmp(compiler->pos, text, strlen(text)) == 0;
+}
+
+static int arith_name_index(ArithCompiler *compiler, const char *name, size_t len) {
+    ArithProgram *program = compiler->program;
+    for (int i = 0; i < program->num_names; i++) {
+        if (strncmp(program->names[i], name, len) == 0 && program->names[i][len] == '\0') {
+            return i;
+        }
+    }
+    program->names = realloc(program->names, (program->num_names + 1) * sizeof(char *));
+    program->names[program->num_names] = strndup(name, len);
+    return program->num_names++;
+}
+
+static void arith_expression(ArithCompiler *compiler, int min_prec);
+
+//Unary operators, constants, variables with assignments and ++/--, and parentheses
+static void arith_unary(ArithCompiler *compiler) {
+    arith_skip_blanks(compiler);
+    const char *c = compiler->pos;
+    if ((c[0] == '+' || c[0] == '-') && c[1] == c[0]) {
+        //Pre-increment or pre-decrement of a variable
+        compiler->pos += 2;
+        arith_skip_blanks(compiler);
+        size_t len = name_length(compiler->pos + (*compiler->pos == '$'));
+        if (len == 0) {
+            compiler->error = "variable expected after ++/--";
+            return;
+        }
+        compiler->pos += *compiler->pos == '$';
+        int name = arith_name_index(compiler, compiler->pos, len);
+        compiler->pos += len;
+        arith_emit(compiler, ARITH_LOAD, name);
+        arith_emit(compiler, ARITH_PUSH, 1);
+        arith_emit(compiler, c[0] == '+' ? ARITH_ADD : ARITH_SUB, 0);
+        arith_emit(compiler, ARITH_STORE, name);
+        return;
+    }
+    if (c[0] == '-' || c[0] == '+' || c[0] == '!' || c[0] == '~') {
+        compiler->pos++;
+        arith_unary(compiler);
+        if (c[0] != '+') {
+            arith_emit(compiler, c[0] == '-' ? ARITH_NEG : c[0] == '!' ? ARITH_NOT : ARITH_BITNOT, 0);
+        }
+        return;
+    }
+    if (c[0] == '(') {
+        compiler->pos++;
+        arith_expression(compiler, 1);
+        if (!arith_at(compiler, ")")) {
+            compiler->error = "missing ')'";
+            return;
+        }
+        compiler->pos++;
+        return;
+    }
+    if (c[0] >= '0' && c[0] <= '9') {
+        //Decimal, 0x hexadecimal or 0 octal
+        char *end;
+        long long value = strtoll(c, &end, 0);
+        compiler->pos = end;
+        arith_emit(compiler, ARITH_PUSH, value);
+        return;
+    }
+
+    size_t len = name_length(c + (c[0] == '$'));
+    if (len == 0) {
+        compiler->error = c[0] == '\0' ? "operand expected" : "syntax error";
+        return;
+    }
+    compiler->pos += (c[0] == '$') + len;
+    int name = arith_name_index(compiler, c + (c[0] == '$'), len);
+
+    //Assignment binds loosest, so its right side is a whole assignment expression
+    arith_skip_blanks(compiler);
+    for (size_t i = 0; i < sizeof(arith_assign) / sizeof(arith_assign[0]); i++) {
+        size_t op_len = strlen(arith_assign[i].text);
+        if (strncmp(compiler->pos, arith_assign[i].text, op_len) == 0 && !(op_len == 1 && compiler->pos[1] == '=')) {
+            compiler->pos += op_len;
+            if (arith_assign[i].op >= 0) {
+                arith_emit(compiler, ARITH_LOAD, name);
+            }
+            arith_expression(compiler, 2);
+            if (arith_assign[i].op >= 0) {
+                arith_emit(compiler, arith_assign[i].op, 0);
+            }
+            arith_emit(compiler, ARITH_STORE, name);
+            return;
+        }
+    }
+    arith_emit(compiler, ARITH_LOAD, name);
+    if ((compiler->pos[0] == '+' || compiler->pos[0] == '-') && compiler->pos[1] == compiler->pos[0]) {
+        //Post-increment leaves the old value
+        int op = compiler->pos[0] == '+' ? ARITH_ADD : ARITH_SUB;
+        compiler->pos += 2;
+        arith_emit(compiler, ARITH_DUP, 0);
+        arith_emit(compiler, ARITH_PUSH, 1);
+        arith_emit(compiler, op, 0);
+        arith_emit(compiler, ARITH_STORE, name);
+        arith_emit(compiler, ARITH_POP, 0);
+    }
+}
+
+//Precedence climbing over the binary operators, ?: and the comma
+static void arith_expression(ArithCompiler *compiler, int min_prec) {
+    arith_unary(compiler);
+    while (compiler->error == NULL) {
+        arith_skip_blanks(compiler);
+        if (min_prec <= 1 && *compiler->pos == ',') {
+            compiler->pos++;
+            arith_emit(compiler, ARITH_POP, 0);
+            arith_unary(compiler);
+            continue;
+        }
+        int found = -1;
+        for (size_t i = 0; i < sizeof(arith_binary) / sizeof(arith_binary[0]); i++) {
+            size_t len = strlen(arith_binary[i].text);
+            //Skip the prefixes of '<<=', '&&' and friends; assignments are handled with the variable
+            if (strncmp(compiler->pos, arith_binary[i].text, len) == 0 && compiler->pos[len] != '=' &&
+                !(len == 1 && (compiler->pos[1] == compiler->pos[0]) && strchr("&|<>", compiler->pos[0]))) {
+                found = i;
+                break;
+            }
+        }
+        if (found < 0 || arith_binary[found].prec < min_prec) {
+            return;
+        }
+        int op = arith_binary[found].op, prec = arith_binary[found].prec;
+        compiler->pos += strlen(arith_binary[found].text);
+        if (op == -1 || op == -2) {
+            //&& and || skip the right side once the result is known
+            int jump = arith_emit(compiler, op == -1 ? ARITH_JZ : ARITH_JNZ, 0);
+            arith_expression(compiler, prec + 1);
+            arith_emit(compiler, ARITH_BOOL, 0);
+            int skip = arith_emit(compiler, ARITH_JMP, 0);
+            compiler->program->code[jump].value = arith_emit(compiler, ARITH_PUSH, op == -1 ? 0 : 1);
+            compiler->program->code[skip].value = compiler->program->length;
+        } else if (op == -3) {
+            int jump = arith_emit(compiler, ARITH_JZ, 0);
+            arith_expression(compiler, 2);
+            if (!arith_at(compiler, ":")) {
+                if (compiler->error == NULL) compiler->error = "':' expected";
+                return;
+            }
+            compiler->pos++;
+            int skip = arith_emit(compiler, ARITH_JMP, 0);
+            compiler->program->code[jump].value = compiler->program->length;
+            arith_expression(compiler, prec);
+            compiler->program->code[skip].value = compiler->program->length;
+        } else {
+            arith_expression(compiler, prec + 1);
+            arith_emit(compiler, op, 0);
+        }
+    }
+}
+
+//Compiled program for an expression, from the cache or freshly compiled. NULL on a syntax error
+static ArithProgram *compile_arithmetic(const char *text) {
+    uint32_t hash = hash_name(text, strlen(text));
+    ArithProgram **slot = &arith_cache[hash & (ARITH_CACHE_SIZE - 1)];
+    if (*slot != NULL && strcmp((*slot)->text, text) == 0) {
+        return *slot;
+    }
+
+    ArithProgram *program = calloc(1, sizeof(ArithProgram));
+    ArithCompiler compiler = { .pos = text, .program = program };
+    arith_expression(&compiler, 1);
+    arith_skip_blanks(&compiler);
+    if (compiler.error == NULL && *compiler.pos != '\0') {
+        compiler.error = "syntax error";
+    }
+    if (compiler.error != NULL) {
+        fprintf(stderr, "Error: %s: %s (at \"%s\")\n", text, compiler.error, compiler.pos);
+        for (int i = 0; i < program->num_names; i++) free(program->names[i]);
+        free(program->names);
+        free(program->code);
+        free(program);
+        return NULL;
+    }
+    program->text = strdup(text);
+
+    //One expression per slot; a collision replaces the older program
+    if (*slot != NULL) {
+        for (int i = 0; i < (*slot)->num_names; i++) free((*slot)->names[i]);
+        free((*slot)->names);
+        free((*slot)->code);
+        free((*slot)->text);
+        free(*slot);
+    }
+    *slot = program;
+    return program;
+}
+
+//Evaluate an integer expression with C operators, assigning variables as it goes. Returns 0 on success
+int evaluate_arithmetic(const char *text, long long *result) {
+    ArithProgram *program = compile_arithmetic(text);
+    if (program == NULL) {
+        return -1;
+    }
+    //Every instruction pushes at most one value
+    long long stack[program->length + 1];
+    int top = 0;
+    for (int pc = 0; pc < program->length; pc++) {
+        ArithInsn *insn = &program->code[pc];
+        long long b = top > 0 ? stack[top - 1] : 0, a = top > 1 ? stack[top - 2] : 0;
+        switch (insn->op) {
+            case ARITH_PUSH: stack[top++] = insn->value; break;
+            case ARITH_LOAD: {
+                const char *value = get_variable(program->names[insn->value]);
+                stack[top++] = value != NULL ? strtoll(value, NULL, 0) : 0;
+                break;
+            }
+            case ARITH_STORE: {
+                char number[32];
+                snprintf(number, sizeof(number), "%lld", b);
+                set_variable(program->names[insn->value], number, 0);
+                break;
+            }
+            case ARITH_POP: top--; break;
+            case ARITH_DUP: stack[top++] = b; break;
+            case ARITH_JZ: top--; if (b == 0) pc = insn->value - 1; break;
+            case ARITH_JNZ: top--; if (b != 0) pc = insn->value - 1; break;
+            case ARITH_JMP: pc = insn->value - 1; break;
+            case ARITH_BOOL: stack[top - 1] = b != 0; break;
+            case ARITH_NEG: stack[top - 1] = -(unsigned long long)b; break;
+            case ARITH_NOT: stack[top - 1] = !b; break;
+            case ARITH_BITNOT: stack[top - 1] = ~b; break;
+            case ARITH_DIV:
+            case ARITH_MOD:
+                if (b == 0) {
+                    fprintf(stderr, "Error: %s: division by zero\n", text);
+                    return -1;
+                }
+                //LLONG_MIN / -1 overflows; wrap like bash
+                stack[top - 2] = b == -1 ? (insn->op == ARITH_DIV ? (long long)-(unsigned long long)a : 0) :
+                                 insn->op == ARITH_DIV ? a / b : a % b;
+                top--;
+                break;
+            default: {
+                long long value = 0;
+                switch (insn->op) {
+                    case ARITH_MUL: value = (unsigned long long)a * b; break;
+                    case ARITH_ADD: value = (unsigned long long)a + b; break;
+                    case ARITH_SUB: value = (unsigned long long)a - b; break;
+                    case ARITH_SHL: value = (unsigned long long)a << (b & 63); break;
+                    case ARITH_SHR: value = a >> (b & 63); break;
+                    case ARITH_LT: value = a < b; break;
+                    case ARITH_LE: value = a <= b; break;
+                    case ARITH_GT: value = a > b; break;
+                    case ARITH_GE: value = a >= b; break;
+                    case ARITH_EQ: value = a == b; break;
+                    case ARITH_NE: value = a != b; break;
+                    case ARITH_AND: value = a & b; break;
+                    case ARITH_XOR: value = a ^ b; break;
+                    case ARITH_OR: value = a | b; break;
+                }
+                stack[top - 2] = value;
+                top--;
+            }
+        }
+    }
+    *result = top > 0 ? stack[top - 1] : 0;
+    return 0;
+}
+
+//Evaluate each argument as an arithmetic expression: 'let EXPR...'. Fails if the last one is 0
+int builtin_let(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "Error: Usage: let EXPRESSION...\n");
+        return 1;
+    }
+    long long result = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (evaluate_arithmetic(args[i], &result) < 0) {
+            return 1;
+        }
+    }
+    return result == 0;
+}
+
+//stat or lstat through the per-line cache. Returns 0 or -1 with errno set
+static int cached_stat(const char *path, int follow, struct stat *st) {
+    for (int i = 0; i < STAT_CACHE_SIZE; i++) {
+        StatCacheEntry *entry = &stat_cache[i];
+        if (entry->generation == line_generation && entry->follow == follow && strcmp(entry->path, path) == 0) {
+            *st = entry->st;
+            errno = entry->result;
+            return entry->result == 0 ? 0 : -1;
+        }
+    }
+    int result = follow ? stat(path, st) : lstat(path, st);
+    if (strlen(path) < PATH_MAX) {
+        StatCacheEntry *entry = &stat_cache[stat_cache_next];
+        stat_cache_next = (stat_cache_next + 1) % STAT_CACHE_SIZE;
+        snprintf(entry->path, sizeof(entry->path), "%s", path);
+        entry->follow = follow;
+        entry->result = result == 0 ? 0 : errno;
+        entry->st = *st;
+        entry->generation = line_generation;
+        errno = entry->result;
+    }
+    return result;
+}
+
+//State of one 'test' evaluation
+typedef struct {
+    char **args;
+    int pos;
+    int end;
+    int extended;          // '[[': && || and pattern matching with == and !=
+    const char *error;
+} TestParser;
+
+static int test_or(TestParser *parser);
+
+static int parse_integer(TestParser *parser, const char *text, long long *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+    while (*end == ' ' || *end == '\t') end++;
+    if (*text == '\0' || *end != '\0' || errno != 0) {
+        parser->error = "integer expression expected";
+        return -1;
+    }
+    return 0;
+}
+
+//File and string tests taking one operand
+static int test_unary(TestParser *parser, const char *op, const char *operand) {
+    struct stat st;
+    switch (op[1]) {
+        case 'z': return operand[0] == '\0';
+        case 'n': return operand[0] != '\0';
+        case 't': {
+            long long fd;
+            return parse_integer(parser, operand, &fd) == 0 && isatty(fd);
+        }
+        case 'r': return access(operand, R_OK) == 0;
+        case 'w': return access(operand, W_OK) == 0;
+        case 'x': return access(operand, X_OK) == 0;
+        case 'L': case 'h': return cached_stat(operand, 0, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+    if (cached_stat(operand, 1, &st) < 0) {
+        return 0;
+    }
+    switch (op[1]) {
+        case 'e': return 1;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'k': return (st.st_mode & S_ISVTX) != 0;
+        case 'O': return st.st_uid == geteuid();
+        case 'G': return st.st_gid == getegid();
+        case 'N': return st.st_mtim.tv_sec > st.st_atim.tv_sec ||
+                         (st.st_mtim.tv_sec == st.st_atim.tv_sec && st.st_mtim.tv_nsec > st.st_atim.tv_nsec);
+    }
+    return 0;
+}
+
+static int is_unary_test(const char *op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("znterwxLhfdbcpSsugkOGN", op[1]) != NULL;
+}
+
+static int is_binary_test(const char *op) {
+    static const char *binary[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", "=~" };
+    for (size_t i = 0; i < sizeof(binary) / sizeof(binary[0]); i++) {
+        if (strcmp(op, binary[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//Comparisons between two operands
+static int test_binary(TestParser *parser, const char *left, const char *op, const char *right) {
+    if (op[0] == '=' || op[0] == '!') {
+        if (strcmp(op, "=~") == 0) {
+            regex_t regex;
+            if (!parser->extended || regcomp(&regex, right, REG_EXTENDED | REG_NOSUB) != 0) {
+                parser->error = "invalid regular expression";
+                return 0;
+            }
+            int match = regexec(&regex, left, 0, NULL, 0) == 0;
+            regfree(&regex);
+            return match;
+        }
+        //In '[[' the right side of == and != is a pattern
+        int equal = parser->extended ? fnmatch(right, left, 0) == 0 : strcmp(left, right) == 0;
+        return op[0] == '!' ? !equal : equal;
+    }
+    if (op[0] == '<' || op[0] == '>') {
+        int order = strcoll(left, right);
+        return op[0] == '<' ? order < 0 : order > 0;
+    }
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat a, b;
+        int has_a = cached_stat(left, 1, &a) == 0, has_b = cached_stat(right, 1, &b) == 0;
+        if (op[1] == 'e') {
+            return has_a && has_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        }
+        //A missing file is older than any existing one
+        if (!has_a || !has_b) {
+            return op[1] == 'n' ? has_a && !has_b : !has_a && has_b;
+        }
+        int newer = a.st_mtim.tv_sec != b.st_mtim.tv_sec ? a.st_mtim.tv_sec > b.st_mtim.tv_sec : a.st_mtim.tv_nsec > b.st_mtim.tv_nsec;
+        int older = a.st_mtim.tv_sec != b.st_mtim.tv_sec ? a.st_mtim.tv_sec < b.st_mtim.tv_sec : a.st_mtim.tv_nsec < b.st_mtim.tv_nsec;
+        return op[1] == 'n' ? newer : older;
+    }
+    long long a, b;
+    if (parse_integer(parser, left, &a) < 0 || parse_integer(parser, right, &b) < 0) {
+        return 0;
+    }
+    switch (op[1] == 'e' ? (op[2] == 'q' ? 0 : -1) : op[1] == 'n' ? 1 : op[1] == 'l' ? (op[2] == 't' ? 2 : 3) : (op[2] == 't' ? 4 : 5)) {
+        case 0: return a == b;
+        case 1: return a != b;
+        case 2: return a < b;
+        case 3: return a <= b;
+        case 4: return a > b;
+        case 5: return a >= b;
+    }
+    return 0;
+}
+
+static int test_primary(TestParser *parser) {
+    char **args = parser->args;
+    int left = parser->end - parser->pos;
+    if (left <= 0) {
+        parser->error = "argument expected";
+        return 0;
+    }
+    const char *first = args[parser->pos];
+    if (strcmp(first, "!") == 0 && left > 1) {
+        parser->pos++;
+        return !test_primary(parser);
+    }
+    if (strcmp(first, "(") == 0 && left > 1) {
+        parser->pos++;
+        int result = test_or(parser);
+        if (parser->pos >= parser->end || strcmp(args[parser->pos], ")") != 0) {
+            parser->error = "')' expected";
+            return 0;
+        }
+        parser->pos++;
+        return result;
+    }
+    //A binary operator wins over a unary one, so '[ -f = -f ]' compares strings
+    if (left >= 3 && is_binary_test(args[parser->pos + 1])) {
+        parser->pos += 3;
+        return test_binary(parser, first, args[parser->pos - 2], args[parser->pos - 1]);
+    }
+    if (left >= 2 && is_unary_test(first)) {
+        parser->pos += 2;
+        return test_unary(parser, first, args[parser->pos - 1]);
+    }
+    parser->pos++;
+    return first[0] != '\0';
+}
+
+static int test_and(TestParser *parser) {
+    int result = test_primary(parser);
+    while (parser->pos < parser->end && parser->error == NULL &&
+           (strcmp(parser->args[parser->pos], "-a") == 0 || (parser->extended && strcmp(parser->args[parser->pos], "&&") == 0))) {
+        parser->pos++;
+        //Evaluated even when the result is known, to consume its operands
+        int right = test_primary(parser);
+        result = result && right;
+    }
+    return result;
+}
+
+static int test_or(TestParser *parser) {
+    int result = test_and(parser);
+    while (parser->pos < parser->end && parser->error == NULL &&
+           (strcmp(parser->args[parser->pos], "-o") == 0 || (parser->extended && strcmp(parser->args[parser->pos], "||") == 0))) {
+        parser->pos++;
+        int right = test_and(parser);
+        result = result || right;
+    }
+    return result;
+}
+
+//Evaluate a condition: 'test EXPR', '[ EXPR ]' or '[[ EXPR ]]'. Returns 0 if true, 1 if false, 2 on error
+int builtin_test(char **args) {
+    int end = 0;
+    while (args[end] != NULL) end++;
+    TestParser parser = { .args = args, .pos = 1, .end = end, .extended = strcmp(args[0], "[[") == 0 };
+    if (strcmp(args[0], "[") == 0 || parser.extended) {
+        const char *close = parser.extended ? "]]" : "]";
+        if (end < 2 || strcmp(args[end - 1], close) != 0) {
+            fprintf(stderr, "Error: %s: missing '%s'\n", args[0], close);
+            return 2;
+        }
+        parser.end--;
+    }
+    //No expression is false
+    if (parser.pos == parser.end) {
+        return 1;
+    }
+    int result = test_or(&parser);
+    if (parser.error == NULL && parser.pos != parser.end) {
+        parser.error = "too many arguments";
+    }
+    if (parser.error != NULL) {
+        fprintf(stderr, "Error: %s: %s\n", args[0], parser.error);
+        return 2;
+    }
+    return !result;
+}
+
+//Read a child's exec status pipe and report a failed exec. End of file means the exec
+//succeeded (or a builtin ran); the 127/126 exit is reaped as usual. Returns 1 on failure
+int report_exec_status(int fd, const char *name) {
+    int exec_errno;
+    ssize_t n;
+    while ((n = read(fd, &exec_errno, sizeof(exec_errno))) < 0 && errno == EINTR);
+    close(fd);
+    if (n == sizeof(exec_errno)) {
+        if (exec_errno == ENOENT) {
+            fprintf(stderr, "Error: %s: command not found\n", name);
+        } else {
+            fprintf(stderr, "Error: %s: %s\n", name, strerror(exec_errno));
+        }
+        return 1;
+    }
+    return 0;
+}
+
+//Wait until every stage started in parallel mode has exec'd or failed. Errors are reported
+//in stage order once all are known. Returns the number of failed stages
+int wait_pending_execs() {
+    struct pollfd fds[MAX_CMDS];
+    for (int i = 0; i < num_pending_execs; i++) {
+        fds[i] = (struct pollfd) { .fd = pending_execs[i].fd, .events = POLLIN };
+    }
+    int remaining = num_pending_execs;
+    while (remaining > 0) {
+        if (poll(fds, num_pending_execs, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < num_pending_execs; i++) {
+            if (fds[i].fd >= 0 && fds[i].revents != 0) {
+                //Readable with data or end of file; stop polling it
+                fds[i].fd = -1;
+                remaining--;
+            }
+        }
+    }
+    int failed = 0;
+    for (int i = 0; i < num_pending_execs; i++) {
+        failed += report_exec_status(pending_execs[i].fd, pending_execs[i].name);
+    }
+    num_pending_execs = 0;
+    return failed;
+}
+
+//Report background stages whose exec has succeeded or failed since the last prompt
+void report_background_execs() {
+    struct pollfd fds[MAX_BACKGROUND_EXECS];
+    for (int i = 0; i < num_background_execs; i++) {
+        fds[i] = (struct pollfd) { .fd = background_execs[i].fd, .events = POLLIN };
+    }
+    if (num_background_execs == 0 || poll(fds, num_background_execs, 0) <= 0) {
+        return;
+    }
+    int kept = 0;
+    for (int i = 0; i < num_background_execs; i++) {
+        if (fds[i].revents == 0) {
+            background_execs[kept++] = background_execs[i];
+            continue;
+        }
+        report_exec_status(background_execs[i].fd, background_execs[i].name);
+        free((char *)background_execs[i].name);
+    }
+    num_background_execs = kept;
+}
+
+//'spawn serial' creates each pipe as its stage is forked, 'spawn parallel' wires the whole
+//pipeline first. Without an argument, prints the mode
+int builtin_spawn(char **args) {
+    if (args[1] == NULL) {
+        printf("spawn: %s\n", spawn_parallel ? "parallel" : "serial");
+    } else if (strcmp(args[1], "serial") == 0 || strcmp(args[1], "parallel") == 0) {
+        spawn_parallel = args[1][0] == 'p';
+    } else {
+        fprintf(stderr, "Error: Usage: spawn [serial | parallel]\n");
+        return 1;
+    }
+    return 0;
+}
+
+//Close the shell's ends of every coprocess in a child that does not exec
+void close_coproc_fds() {
+    for (int i = 0; i < MAX_COPROCS; i++) {
+        if (coprocs[i].name[0] != '\0') {
+            close(coprocs[i].in_fd);
+            close(coprocs[i].out_fd);
+        }
+    }
+}
+
+//Close the shell's ends of a coprocess; it sees end of file on its input
+static void close_coproc(Coproc *coproc) {
+    close(coproc->in_fd);
+    close(coproc->out_fd);
+    coproc->name[0] = '\0';
+}
+
+//Start a command connected to the shell by two pipes:
+//  coproc [-n NAME] command [args...]   NAME_IN, NAME_OUT and NAME_PID are set (NAME defaults to COPROC)
+//  coproc -c NAME                       close the shell's ends
+//  coproc                               list coprocesses
+int builtin_coproc(char **args) {
+    if (args[1] == NULL) {
+        for (int i = 0; i < MAX_COPROCS; i++) {
+            if (coprocs[i].name[0] != '\0') {
+                printf("%s: pid %d in %d out %d\n", coprocs[i].name, coprocs[i].pid, coprocs[i].in_fd, coprocs[i].out_fd);
+            }
+        }
+        return 0;
+    }
+    const char *name = "COPROC";
+    int i = 1;
+    if ((strcmp(args[1], "-n") == 0 || strcmp(args[1], "-c") == 0) && args[2] != NULL) {
+        name = args[2];
+        i = 3;
+    }
+    if (name_length(name) != strlen(name) || strlen(name) >= sizeof(coprocs[0].name) - 8) {
+        fprintf(stderr, "Error: coproc: Invalid name: %s\n", name);
+        return 1;
+    }
+
+    Coproc *coproc = NULL, *free_slot = NULL;
+    for (int c = 0; c < MAX_COPROCS; c++) {
+        if (strcmp(coprocs[c].name, name) == 0) {
+            coproc = &coprocs[c];
+        } else if (coprocs[c].name[0] == '\0' && free_slot == NULL) {
+            free_slot = &coprocs[c];
+        }
+    }
+    if (strcmp(args[1], "-c") == 0) {
+        if (coproc == NULL) {
+            fprintf(stderr, "Error: coproc: No coprocess named %s\n", name);
+            return 1;
+        }
+        close_coproc(coproc);
+        return 0;
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "Error: Usage: coproc [-n NAME] command [args...] | coproc -c NAME\n");
+        return 1;
+    }
+    if (coproc != NULL) {
+        //Reusing a name drops the old coprocess's pipes
+        close_coproc(coproc);
+    } else if ((coproc = free_slot) == NULL) {
+        fprintf(stderr, "Error: coproc: Too many coprocesses.\n");
+        return 1;
+    }
+
+    //The shell's ends are close-on-exec so later commands do not keep the coprocess alive
+    int to_coproc[2], from_coproc[2];
+    if (pipe2(to_coproc, O_CLOEXEC) < 0) {
+        perror("Error creating pipe");
+        return 1;
+    }
+    if (pipe2(from_coproc, O_CLOEXEC) < 0) {
+        perror("Error creating pipe");
+        close(to_coproc[0]);
+        close(to_coproc[1]);
+        return 1;
+    }
+
+    //Run it as a background job, so it shows in 'jobs' and is reaped as usual
+    CmdSet cmdset = { .num_commands = 1 };
+    cmdset.commands[0] = (Cmd) { .args = args + i, .background = 1, .input_dup = -1, .output_dup = -1 };
+    current_envp();
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old_mask);
+    current_job = create_job(&cmdset);
+    pipeline_fds[0] = to_coproc[1];
+    pipeline_fds[1] = from_coproc[0];
+    num_pipeline_fds = 2;
+    last_background_pid = 0;
+    //The coprocess is only registered once its exec is confirmed
+    defer_exec_status = 1;
+    execute_single_command(&cmdset.commands[0], to_coproc[0], from_coproc[1]);
+    defer_exec_status = 0;
+    num_pipeline_fds = 0;
+    current_job = NULL;
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    int failed = wait_pending_execs();
+    close(to_coproc[0]);
+    close(from_coproc[1]);
+    if (failed || last_background_pid == 0) {
+        close(to_coproc[1]);
+        close(from_coproc[0]);
+        return 1;
+    }
+
+    *coproc = (Coproc) { .in_fd = to_coproc[1], .out_fd = from_coproc[0], .pid = last_background_pid };
+    snprintf(coproc->name, sizeof(coproc->name), "%s", name);
+    char variable[sizeof(coproc->name) + 8], value[16];
+    snprintf(variable, sizeof(variable), "%s_IN", name);
+    snprintf(value, sizeof(value), "%d", coproc->in_fd);
+    set_variable(variable, value, 0);
+    snprintf(variable, sizeof(variable), "%s_OUT", name);
+    snprintf(value, sizeof(value), "%d", coproc->out_fd);
+    set_variable(variable, value, 0);
+    snprintf(variable, sizeof(variable), "%s_PID", name);
+    snprintf(value, sizeof(value), "%d", coproc->pid);
+    set_variable(variable, value, 0);
+    return 0;
+}
+
+//Read one character from fd, through the buffer of the coprocess reading it if any.
+//Other descriptors are read a byte at a time so no input meant for later commands is consumed
+static int read_char(int fd, char *c) {
+    for (int i = 0; i < MAX_COPROCS; i++) {
+        Coproc *coproc = &coprocs[i];
+        if (coproc->name[0] == '\0' || (coproc->out_fd != fd && !(fd == STDIN_FILENO && coproc->out_fd == builtin_input_dup))) {
+            continue;
+        }
+        if (coproc->buffer_start == coproc->buffer_end) {
+            ssize_t n;
+            while ((n = read(fd, coproc->buffer, sizeof(coproc->buffer))) < 0 && errno == EINTR);
+            if (n <= 0) {
+                return 0;
+            }
+            coproc->buffer_start = 0;
+            coproc->buffer_end = n;
+        }
+        *c = coproc->buffer[coproc->buffer_start++];
+        return 1;
+    }
+    ssize_t n;
+    while ((n = read(fd, c, 1)) < 0 && errno == EINTR);
+    return n == 1;
+}
+
+//Read a line into variables: 'read [-u FD] [NAME...]'. Words go to the names in order, the
+//last name taking the rest of the line; REPLY without names. Fails at end of input
+int builtin_read(char **args) {
+    int fd = STDIN_FILENO, i = 1;
+    if (args[1] != NULL && strcmp(args[1], "-u") == 0) {
+        char *end;
+        fd = args[2] != NULL ? strtol(args[2], &end, 10) : -1;
+        if (args[2] == NULL || *end != '\0' || fd < 0) {
+            fprintf(stderr, "Error: Usage: read [-u FD] [NAME...]\n");
+            return 2;
+        }
+        i = 3;
+    }
+    char line[MAX_CMD_LENGTH * 4];
+    size_t len = 0;
+    char c;
+    int got = 0;
+    while (read_char(fd, &c)) {
+        got = 1;
+        if (c == '\n') {
+            break;
+        }
+        if (len < sizeof(line) - 1) {
+            line[len++] = c;
+        }
+    }
+    line[len] = '\0';
+    if (!got) {
+        return 1;
+    }
+
+    if (args[i] == NULL) {
+        set_variable("REPLY", line, 0);
+        return 0;
+    }
+    char *word = line;
+    for (; args[i] != NULL; i++) {
+        while (*word == ' ' || *word == '\t') word++;
+        char *end = word;
+        if (args[i + 1] != NULL) {
+            while (*end != '\0' && *end != ' ' && *end != '\t') end++;
+        } else {
+            //The last name keeps inner blanks but not trailing ones
+            end = word + strlen(word);
+            while (end > word && (end[-1] == ' ' || end[-1] == '\t')) end--;
+        }
+        char saved = *end;
+        *end = '\0';
+        if (name_length(args[i]) == strlen(args[i])) {
+            set_variable(args[i], word, 0);
+        } else {
+            fprintf(stderr, "Error: read: Invalid name: %s\n", args[i]);
+        }
+        *end = saved;
+        word = end;
+    }
+    return 0;
+}
+
+//Check the named streams of a line: each needs a writer and a reader, its writers must all
+//use '->' or all '=>', and the stages must not feed back into themselves.
+//Returns 1 when the line uses streams, 0 when it does not and -1 after reporting an error
+int check_streams(const CmdSet *cmdset) {
+    int n = cmdset->num_commands, graph = 0;
+    //feeds[i][j]: stage i's output reaches stage j, directly or not
+    char feeds[MAX_CMDS][MAX_CMDS] = { { 0 } };
+    for (int i = 0; i < n; i++) {
+        const Cmd *cmd = &cmdset->commands[i];
+        const char *names[2] = { cmd->read_stream, cmd->write_stream };
+        for (int k = 0; k < 2; k++) {
+            if (names[k] == NULL) {
+                continue;
+            }
+            graph = 1;
+            if (names[k][0] == '\0' || name_length(names[k]) != strlen(names[k])) {
+                fprintf(stderr, "Error: Bad stream name: %s\n", names[k]);
+                return -1;
+            }
+            int writers = 0, readers = 0, atomic = 0;
+            for (int j = 0; j < n; j++) {
+                const Cmd *other = &cmdset->commands[j];
+                if (other->write_stream != NULL && strcmp(other->write_stream, names[k]) == 0) {
+                    writers++;
+                    atomic += other->write_atomic;
+                }
+                if (other->read_stream != NULL && strcmp(other->read_stream, names[k]) == 0) {
+                    readers++;
+                    if (k == 1) {
+                        feeds[i][j] = 1;
+                    }
+                }
+            }
+            if (writers == 0 || readers == 0) {
+                fprintf(stderr, "Error: Stream %s has no %s.\n", names[k], writers == 0 ? "writer" : "reader");
+                return -1;
+            }
+            if (atomic != 0 && atomic != writers) {
+                fprintf(stderr, "Error: Stream %s mixes '->' and '=>' writers.\n", names[k]);
+                return -1;
+            }
+        }
+        //'|' still joins neighbours that do not use a stream on that side
+        if (i < n - 1 && cmd->write_stream == NULL && cmdset->commands[i + 1].read_stream == NULL) {
+            feeds[i][i + 1] = 1;
+        }
+    }
+    for (int k = 0; k < n; k++) {
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; graph && feeds[i][k] && j < n; j++) {
+                feeds[i][j] |= feeds[k][j];
+            }
+        }
+    }
+    for (int i = 0; graph && i < n; i++) {
+        if (feeds[i][i]) {
+            fprintf(stderr, "Error: Streams form a cycle through %s.\n", cmdset->commands[i].args[0]);
+            return -1;
+        }
+    }
+    return graph;
+}
+
+//Send a chunk to every reader still open. Readers that went away are dropped, like tee -p;
+//the relay ends once none are left, so its writers get SIGPIPE
+static void relay_emit(StreamRelay *relay, const char *data, size_t len) {
+    int open_outputs = 0;
+    for (int i = 0; i < relay->num_outputs; i++) {
+        for (size_t done = 0; relay->outputs[i] >= 0 && done < len;) {
+            ssize_t n = write(relay->outputs[i], data + done, len - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                close(relay->outputs[i]);
+                relay->outputs[i] = -1;
+                break;
+            }
+            done += n;
+        }
+        open_outputs += relay->outputs[i] >= 0;
+    }
+    if (open_outputs == 0) {
+        _exit(0);
+    }
+}
+
+//Body of a relay process. An ordered stream passes the current writer straight through and
+//buffers the others until their turn; a line-atomic one passes each writer's complete lines
+//as they arrive, so lines from different writers never mix
+static void run_relay(StreamRelay *relay) {
+    char *data[MAX_CMDS];
+    size_t len[MAX_CMDS] = { 0 }, size[MAX_CMDS];
+    int eof[MAX_CMDS] = { 0 };
+    for (int i = 0; i < relay->num_inputs; i++) {
+        size[i] = RELAY_CHUNK;
+        data[i] = malloc(size[i]);
+    }
+    int current = 0;
+    for (;;) {
+        while (!relay->atomic && current < relay->num_inputs) {
+            if (len[current] > 0) {
+                relay_emit(relay, data[current], len[current]);
+                len[current] = 0;
+            }
+            if (!eof[current]) {
+                break;
+            }
+            current++;
+        }
+
+        //A writer waiting its turn is not read past RELAY_BUFFER_MAX, which blocks it
+        struct pollfd fds[MAX_CMDS];
+        int polled[MAX_CMDS], num_polled = 0;
+        for (int i = 0; i < relay->num_inputs; i++) {
+            if (!eof[i] && (relay->atomic || len[i] + RELAY_CHUNK <= RELAY_BUFFER_MAX)) {
+                fds[num_polled] = (struct pollfd) { .fd = relay->inputs[i], .events = POLLIN };
+                polled[num_polled++] = i;
+            }
+        }
+        if (num_polled == 0) {
+            break;
+        }
+        if (poll(fds, num_polled, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int p = 0; p < num_polled; p++) {
+            int i = polled[p];
+            if (fds[p].revents == 0) {
+                continue;
+            }
+            if (!relay->atomic && len[i] + RELAY_CHUNK > size[i]) {
+                size[i] *= 2;
+                data[i] = realloc(data[i], size[i]);
+            }
+            size_t room = size[i] - len[i] < RELAY_CHUNK ? size[i] - len[i] : RELAY_CHUNK;
+            ssize_t n = read(relay->inputs[i], data[i] + len[i], room);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                eof[i] = 1;
+            } else {
+                len[i] += n;
+            }
+            if (!relay->atomic) {
+                continue;
+            }
+
+            //Pass on up to the last newline; a line longer than the buffer, or an
+            //unterminated last line, goes out as it is
+            size_t end = len[i];
+            if (!eof[i] && len[i] < size[i]) {
+                while (end > 0 && data[i][end - 1] != '\n') end--;
+            }
+            if (end > 0) {
+                relay_emit(relay, data[i], end);
+                memmove(data[i], data[i] + end, len[i] - end);
+                len[i] -= end;
+            }
+        }
+    }
+}
+
+//Make a pipe for a line being wired and record both ends in pipeline_fds
+static int pipeline_pipe(int *read_end, int *write_end) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("Error creating pipe");
+        return -1;
+    }
+    pipeline_fds[num_pipeline_fds++] = *read_end = fds[0];
+    pipeline_fds[num_pipeline_fds++] = *write_end = fds[1];
+    return 0;
+}
+
+//Drop the pipes of a line that could not be wired
+static void close_pipeline_fds() {
+    for (int f = 0; f < num_pipeline_fds; f++) {
+        close(pipeline_fds[f]);
+    }
+    num_pipeline_fds = 0;
+}
+
+//Create every pipe of a line before its first fork, in pipeline_fds, and start the relays of
+//its streams. A stream with one writer and one reader is a plain pipe; otherwise its writers
+//and readers each get a pipe to a relay. Returns -1 if a pipe or relay could not be created
+int wire_pipeline(CmdSet *cmdset, int *stage_input, int *stage_output) {
+    int n = cmdset->num_commands;
+    StreamRelay relays[MAX_CMDS];
+    int num_relays = 0;
+    num_pipeline_fds = 0;
+    for (int i = 0; i < n; i++) {
+        stage_input[i] = STDIN_FILENO;
+        stage_output[i] = STDOUT_FILENO;
+    }
+
+    for (int i = 0; i < n - 1; i++) {
+        if (cmdset->commands[i].write_stream != NULL || cmdset->commands[i + 1].read_stream != NULL) {
+            continue;
+        }
+        if (pipeline_pipe(&stage_input[i + 1], &stage_output[i]) < 0) {
+            close_pipeline_fds();
+            return -1;
+        }
+    }
+
+    //Each stream is set up at its first writer
+    for (int i = 0; i < n; i++) {
+        const char *name = cmdset->commands[i].write_stream;
+        int first = 1;
+        for (int j = 0; name != NULL && j < i; j++) {
+            first &= cmdset->commands[j].write_stream == NULL || strcmp(cmdset->commands[j].write_stream, name) != 0;
+        }
+        if (name == NULL || !first) {
+            continue;
+        }
+        int writers[MAX_CMDS], readers[MAX_CMDS], num_writers = 0, num_readers = 0;
+        for (int j = 0; j < n; j++) {
+            Cmd *cmd = &cmdset->commands[j];
+            if (cmd->write_stream != NULL && strcmp(cmd->write_stream, name) == 0) {
+                writers[num_writers++] = j;
+            }
+            if (cmd->read_stream != NULL && strcmp(cmd->read_stream, name) == 0) {
+                readers[num_readers++] = j;
+            }
+        }
+
+        if (num_writers == 1 && num_readers == 1) {
+            if (pipeline_pipe(&stage_input[readers[0]], &stage_output[writers[0]]) < 0) {
+                close_pipeline_fds();
+                return -1;
+            }
+            continue;
+        }
+        StreamRelay *relay = &relays[num_relays++];
+        *relay = (StreamRelay) { .atomic = cmdset->commands[i].write_atomic };
+        for (int w = 0; w < num_writers; w++) {
+            if (pipeline_pipe(&relay->inputs[relay->num_inputs++], &stage_output[writers[w]]) < 0) {
+                close_pipeline_fds();
+                return -1;
+            }
+        }
+        for (int r = 0; r < num_readers; r++) {
+            if (pipeline_pipe(&stage_input[readers[r]], &relay->outputs[relay->num_outputs++]) < 0) {
+                close_pipeline_fds();
+                return -1;
+            }
+        }
+    }
+
+    //Relays run in the job's cgroup, and the shell waits for them with the stages
+    for (int r = 0; r < num_relays; r++) {
+        StreamRelay *relay = &relays[r];
+        pid_t pid = spawn_process(current_job != NULL ? current_job->cgroup_fd : -1);
+        if (pid < 0) {
+            //Relays already started see end of file once the shell's ends are closed
+            perror("fork failed");
+            close_pipeline_fds();
+            return -1;
+        }
+        if (pid == 0) {
+            sigset_t unblock;
+            sigemptyset(&unblock);
+            sigaddset(&unblock, SIGCHLD);
+            sigprocmask(SIG_UNBLOCK, &unblock, NULL);
+            signal(SIGCHLD, SIG_DFL);
+            signal(SIGPIPE, SIG_IGN);
+            //Keep only this relay's ends, or readers would never see end of file
+            for (int f = 0; f < num_pipeline_fds; f++) {
+                int own = 0;
+                for (int k = 0; k < relay->num_inputs; k++) own |= relay->inputs[k] == pipeline_fds[f];
+                for (int k = 0; k < relay->num_outputs; k++) own |= relay->outputs[k] == pipeline_fds[f];
+                if (!own) {
+                    close(pipeline_fds[f]);
+                }
+            }
+            run_relay(relay);
+            _exit(0);
+        }
+        if (!cmdset->commands[0].background) {
+            foreground_pids[num_foreground_pids++] = pid;
+        }
+    }
+    return 0;
+}
+
+//Length of the next line a merge input can give, newline included, or 0 if it is not complete.
+//A full buffer without a newline and an unterminated last line count as lines
+static size_t merge_line_length(const MergeInput *input) {
+    const char *head = input->data + input->start;
+    size_t available = input->len - input->start;
+    const char *newline = memchr(head, '\n', available);
+    if (newline != NULL) {
+        return newline - head + 1;
+    }
+    return (input->fd < 0 || available == MERGE_BUFFER) ? available : 0;
+}
+
+//Write out whatever merge has collected
+static int merge_flush(char *out, size_t *out_len) {
+    for (size_t done = 0; done < *out_len;) {
+        ssize_t n = write(STDOUT_FILENO, out + done, *out_len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        done += n;
+    }
+    *out_len = 0;
+    return 0;
+}
+
+//Move the next line of an input to the output buffer with the requested prefixes
+static int merge_emit(MergeInput *input, size_t line_len, char *out, size_t *out_len, int prefix_job, int timestamp) {
+    char prefix[64];
+    size_t prefix_len = 0;
+    if (timestamp) {
+        struct timespec now;
+        struct tm local;
+        clock_gettime(CLOCK_REALTIME, &now);
+        localtime_r(&now.tv_sec, &local);
+        prefix_len += strftime(prefix, sizeof(prefix), "%H:%M:%S", &local);
+        prefix_len += snprintf(prefix + prefix_len, sizeof(prefix) - prefix_len, ".%03ld ", now.tv_nsec / 1000000);
+    }
+    if (prefix_job) {
+        prefix_len += snprintf(prefix + prefix_len, sizeof(prefix) - prefix_len, "[%d] ", input->job_id);
+    }
+    const char *line = input->data + input->start;
+    int add_newline = line[line_len - 1] != '\n';
+    if (*out_len + prefix_len + line_len + add_newline > MERGE_BUFFER + sizeof(prefix) && merge_flush(out, out_len) < 0) {
+        return -1;
+    }
+    memcpy(out + *out_len, prefix, prefix_len);
+    memcpy(out + *out_len + prefix_len, line, line_len);
+    *out_len += prefix_len + line_len;
+    if (add_newline) {
+        out[(*out_len)++] = '\n';
+    }
+    input->start += line_len;
+    return 0;
+}
+
+//Compare the next lines of two inputs as 'LC_ALL=C sort' does, without their newlines
+static int merge_compare(const MergeInput *a, size_t a_len, const MergeInput *b, size_t b_len) {
+    a_len -= a->data[a->start + a_len - 1] == '\n';
+    b_len -= b->data[b->start + b_len - 1] == '\n';
+    int order = memcmp(a->data + a->start, b->data + b->start, a_len < b_len ? a_len : b_len);
+    return order != 0 ? order : (a_len > b_len) - (a_len < b_len);
+}
+
+//Run commands concurrently and print their output a whole line at a time:
+//  merge [-p] [-t] [-s] command [args...] ::: command [args...] ...
+//-p prefixes each line with its command's job number, -t with the time it arrived, and -s
+//merges inputs that are each sorted into one sorted output. Every command is its own job
+//reading /dev/null; its stderr is not merged
+int builtin_merge(char **args) {
+    int prefix_job = 0, timestamp = 0, sorted = 0, i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        for (const char *flag = args[i] + 1; *flag != '\0'; flag++) {
+            if (*flag == 'p') prefix_job = 1;
+            else if (*flag == 't') timestamp = 1;
+            else if (*flag == 's') sorted = 1;
+            else {
+                fprintf(stderr, "Error: Usage: merge [-p] [-t] [-s] command [args...] ::: command [args...] ...\n");
+                return 2;
+            }
+        }
+    }
+
+    //Split the remaining words into commands at each ':::'
+    char **commands[MAX_CMDS];
+    int num_inputs = 0;
+    for (int start = i; args[start] != NULL; ) {
+        int end = start;
+        while (args[end] != NULL && strcmp(args[end], ":::") != 0) end++;
+        if (end > start) {
+            if (num_inputs == MAX_CMDS) {
+                fprintf(stderr, "Error: merge: At most %d commands.\n", MAX_CMDS);
+                return 2;
+            }
+            commands[num_inputs] = malloc((end - start + 1) * sizeof(char *));
+            memcpy(commands[num_inputs], args + start, (end - start) * sizeof(char *));
+            commands[num_inputs++][end - start] = NULL;
+        }
+        start = args[end] != NULL ? end + 1 : end;
+    }
+    if (num_inputs == 0) {
+        fprintf(stderr, "Error: Usage: merge [-p] [-t] [-s] command [args...] ::: command [args...] ...\n");
+        return 2;
+    }
+
+    //Pipes are enlarged so chatty commands rarely block on the merge
+    MergeInput inputs[MAX_CMDS];
+    int write_ends[MAX_CMDS];
+    for (int c = 0; c < num_inputs; c++) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("Error creating pipe");
+            for (int k = 0; k < c; k++) {
+                close(inputs[k].fd);
+                close(write_ends[k]);
+            }
+            for (int k = 0; k < num_inputs; k++) free(commands[k]);
+            return 1;
+        }
+        fcntl(fds[0], F_SETPIPE_SZ, MERGE_BUFFER);
+        inputs[c] = (MergeInput) { .fd = fds[0] };
+        write_ends[c] = fds[1];
+        pipeline_fds[2 * c] = fds[0];
+        pipeline_fds[2 * c + 1] = fds[1];
+    }
+
+    //When merge is a pipeline stage, the PIDs copied from the shell are not our children
+    num_foreground_pids = 0;
+    fflush(stdout);
+    current_envp();
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old_mask);
+    num_pipeline_fds = 2 * num_inputs;
+    defer_exec_status = 1;
+    Job *input_jobs[MAX_CMDS];
+    for (int c = 0; c < num_inputs; c++) {
+        CmdSet cmdset = { .num_commands = 1 };
+        cmdset.commands[0] = (Cmd) { .args = commands[c], .input_file = "/dev/null", .input_dup = -1, .output_dup = -1 };
+        input_jobs[c] = current_job = create_job(&cmdset);
+        inputs[c].job_id = current_job != NULL ? current_job->id : 0;
+        execute_single_command(&cmdset.commands[0], STDIN_FILENO, write_ends[c]);
+    }
+    current_job = NULL;
+    num_pipeline_fds = 0;
+    defer_exec_status = 0;
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    wait_pending_execs();
+    for (int c = 0; c < num_inputs; c++) {
+        close(write_ends[c]);
+        free(commands[c]);
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("Error: epoll_create1");
+    }
+    int open_inputs = 0;
+    for (int c = 0; c < num_inputs && epoll_fd >= 0; c++) {
+        inputs[c].data = malloc(MERGE_BUFFER);
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = c };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inputs[c].fd, &event);
+        inputs[c].armed = 1;
+        open_inputs++;
+    }
+    char *out = malloc(MERGE_BUFFER + 64);
+    size_t out_len = 0;
+    int failed = epoll_fd < 0;
+
+    while (!failed) {
+        if (sorted) {
+            //Emit the smallest next line while every open input has one to compare
+            for (;;) {
+                int best = -1, waiting = 0;
+                size_t best_len = 0;
+                for (int c = 0; c < num_inputs; c++) {
+                    size_t len = merge_line_length(&inputs[c]);
+                    if (len == 0) {
+                        waiting |= inputs[c].fd >= 0;
+                    } else if (best < 0 || merge_compare(&inputs[c], len, &inputs[best], best_len) < 0) {
+                        best = c;
+                        best_len = len;
+                    }
+                }
+                if (waiting || best < 0) {
+                    break;
+                }
+                if (merge_emit(&inputs[best], best_len, out, &out_len, prefix_job, timestamp) < 0) {
+                    failed = 1;
+                    break;
+                }
+            }
+        }
+        if (failed || open_inputs == 0) {
+            break;
+        }
+
+        //Output goes out before blocking; a full buffer is not read until it drains
+        if (out_len > 0 && merge_flush(out, &out_len) < 0) {
+            failed = 1;
+            break;
+        }
+        for (int c = 0; c < num_inputs; c++) {
+            MergeInput *input = &inputs[c];
+            if (input->fd < 0) {
+                continue;
+            }
+            if (input->start > 0) {
+                memmove(input->data, input->data + input->start, input->len - input->start);
+                input->len -= input->start;
+                input->start = 0;
+            }
+            //A full input leaves the epoll set, since a hangup is reported even without EPOLLIN
+            //and reading it now would look like end of file
+            int want = input->len < MERGE_BUFFER;
+            if (want != input->armed) {
+                struct epoll_event event = { .events = EPOLLIN, .data.u32 = c };
+                epoll_ctl(epoll_fd, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, input->fd, &event);
+                input->armed = want;
+            }
+        }
+
+        struct epoll_event events[MAX_CMDS];
+        int ready = epoll_wait(epoll_fd, events, MAX_CMDS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("Error: epoll_wait");
+            break;
+        }
+        for (int e = 0; e < ready && !failed; e++) {
+            MergeInput *input = &inputs[events[e].data.u32];
+            ssize_t n = read(input->fd, input->data + input->len, MERGE_BUFFER - input->len);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, input->fd, NULL);
+                close(input->fd);
+                input->fd = -1;
+                open_inputs--;
+            } else {
+                input->len += n;
+            }
+            size_t len;
+            while (!sorted && (len = merge_line_length(input)) > 0) {
+                if (merge_emit(input, len, out, &out_len, prefix_job, timestamp) < 0) {
+                    failed = 1;
+                    break;
+                }
+            }
+        }
+    }
+    if (!failed && out_len > 0) {
+        failed = merge_flush(out, &out_len) < 0;
+    }
+
+    //A failed write leaves the commands to SIGPIPE once their pipes close
+    for (int c = 0; c < num_inputs; c++) {
+        if (inputs[c].fd >= 0) {
+            close(inputs[c].fd);
+        }
+        free(inputs[c].data);
+    }
+    free(out);
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    handle_foreground_pids();
+
+    int status = failed;
+    for (int c = 0; c < num_inputs; c++) {
+        if (input_jobs[c] != NULL && input_jobs[c]->status != 0) {
+            status = 1;
+        }
+    }
+    return status;
+}